@@ -10,17 +10,19 @@ extern "C" {
 
 // The internals of this struct are MCU-specific
 typedef struct {
-    // Implementation for STM32 HAL
-    uint32_t pin_num;
-    bool     pwm_capable;
+    // Implementation for the Arduino framework.  Pin capabilities come
+    // from the core's variant macros and the pin number is the entry's
+    // index in gpio_map[], so nothing is stored; C needs one member.
+    uint8_t unused;
 } gpio_pin_t;
 
 // This API is MCU-independent
-int  set_gpio(gpio_pin_t* gpio, bool high);
-bool get_gpio(gpio_pin_t* gpio);
-int  set_pwm(gpio_pin_t* gpio, int32_t numerator, uint32_t denominator);
-void deinit_gpio(gpio_pin_t* gpio);
-bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode);
+int  set_gpio(const gpio_pin_t* gpio, bool high);
+void set_gpio_group(const gpio_pin_t* group[], const bool high[], int count);
+bool get_gpio(const gpio_pin_t* gpio);
+int  set_pwm(const gpio_pin_t* gpio, int32_t numerator, uint32_t denominator);
+void deinit_gpio(const gpio_pin_t* gpio);
+bool set_gpio_mode(const gpio_pin_t* gpio, pin_mode_t pinmode);
 
 #ifdef __cplusplus
 }
@@ -10,12 +10,14 @@
 extern "C" {
 #endif
 
-extern pin_t gpios[];
-
-extern void init_gpiomap();
+extern const gpio_pin_t gpio_map[];
+extern pin_t            gpios[];
 
 #define n_pins NUM_DIGITAL_PINS
 
+// The Arduino pin number of a gpio_map[] entry is its index
+#define gpio_pin_num(gpio) ((uint8_t)((gpio) - gpio_map))
+
 #ifdef __cplusplus
 }
 #endif
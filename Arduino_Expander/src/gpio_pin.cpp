@@ -14,39 +14,63 @@
 extern "C" {
 #endif
 
-int set_gpio(gpio_pin_t* gpio, bool high) {
-    digitalWrite(gpio->pin_num, high);
+#ifndef pinIsAnalogInput
+#    define pinIsAnalogInput(i) false
+#endif
+
+int set_gpio(const gpio_pin_t* gpio, bool high) {
+    digitalWrite(gpio_pin_num(gpio), high);
     return true;
 }
-bool get_gpio(gpio_pin_t* gpio) {
-    return digitalRead(gpio->pin_num);
+// The Arduino API has no portable way to write several pins at once,
+// so the pins change one after another
+void set_gpio_group(const gpio_pin_t* group[], const bool high[], int count) {
+    for (int i = 0; i < count; i++) {
+        digitalWrite(gpio_pin_num(group[i]), high[i]);
+    }
+}
+bool get_gpio(const gpio_pin_t* gpio) {
+    return digitalRead(gpio_pin_num(gpio));
 }
-int set_pwm(gpio_pin_t* gpio, int32_t numerator, uint32_t denominator) {
+int set_pwm(const gpio_pin_t* gpio, int32_t numerator, uint32_t denominator) {
     // uint32_t pwm_val = 255 * numerator / denominator; // map 0.0-100.0 to 0 to 255
     //        analogWrite(stm_pin_num, pwm_val);
     return true;
 }
-void deinit_gpio(gpio_pin_t* gpio) {
-    pinMode(gpio->pin_num, INPUT);
+pin_set_t get_gpio_levels(pin_set_t pins) {
+    pin_set_t levels = 0;
+    for (; pins; pins &= pins - 1) {
+        uint8_t pin_num = __builtin_ctzll(pins);
+        if (digitalRead(pin_num)) {
+            levels |= (pin_set_t)1 << pin_num;
+        }
+    }
+    return levels;
 }
-bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode) {
+void deinit_gpio(const gpio_pin_t* gpio) {
+    pinMode(gpio_pin_num(gpio), INPUT);
+}
+bool set_gpio_mode(const gpio_pin_t* gpio, pin_mode_t pinmode) {
     if (pinmode & PIN_OUTPUT) {
-        pinMode(gpio->pin_num, OUTPUT);
+        pinMode(gpio_pin_num(gpio), OUTPUT);
 
-        digitalWrite(gpio->pin_num, !!(pinmode & PIN_ACTIVELOW));
+        digitalWrite(gpio_pin_num(gpio), !!(pinmode & PIN_ACTIVELOW));
     }
     if (pinmode & PIN_PWM) {
-        if (!gpio->pwm_capable) {
+        if (!pinIsAnalogInput(gpio_pin_num(gpio))) {
             return false;
         }
 #ifdef INPUT_ANALOG
-        pinMode(gpio->pin_num, INPUT_ANALOG);
+        pinMode(gpio_pin_num(gpio), INPUT_ANALOG);
         return true;
 #else
         return false;
 #endif
     }
     if (pinmode & PIN_INPUT) {
+        if (pinmode & PIN_IRQ) {
+            return false;  // Interrupt capture is not implemented
+        }
         uint32_t mode;
         if (pinmode & PIN_PULLUP) {
             mode = INPUT_PULLUP;
@@ -59,12 +83,17 @@ bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode) {
         } else {
             mode = INPUT;
         }
-        pinMode(gpio->pin_num, mode);
+        pinMode(gpio_pin_num(gpio), mode);
         return true;
     }
     return false;
 }
 
+// Inputs are only polled, so there are never any captured events
+bool get_gpio_event(gpio_event_t* event) {
+    return false;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,25 +4,17 @@
 #include "pin.h"
 #include "gpiomap.h"
 
-// The pins table maps io numbers (the table index) to
-// device-specific and board-specific pin numbers
+// Arduino pin numbers are the io numbers, so gpio_map[] only supplies
+// an address per pin and gpio_pin_num() recovers the number from it.
+// The table is never read, so it stays in flash; the state of each pin
+// is kept separately in gpios[].
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-pin_t gpios[NUM_DIGITAL_PINS];
-
-#ifndef pinIsAnalogInput
-#    define pinIsAnalogInput(i) false
-#endif
-
-void init_gpiomap() {
-    for (size_t i = 0; i < NUM_DIGITAL_PINS; i++) {
-        gpio_pin_t gpio = { i, pinIsAnalogInput(i) };
-        gpios[i].gpio   = gpio;
-    }
-}
+const gpio_pin_t gpio_map[NUM_DIGITAL_PINS] PROGMEM = {};
+pin_t            gpios[NUM_DIGITAL_PINS];
 
 #ifdef __cplusplus
 }
@@ -4,6 +4,10 @@
 #include "gpiomap.h"
 
 #define FNCSerial Serial  // connects STM32 to ESP32 and FNC
+#define FNC_BAUD 115200
+#ifndef FNC_MAX_BAUD
+#    define FNC_MAX_BAUD 1000000
+#endif
 #ifdef USE_DEBUG_SERIAL
 #    define DebugSerial Serial2  // connects STM32 to Debug terminal
 #endif
@@ -27,6 +31,28 @@ int milliseconds() {
     return millis();
 }
 
+// Return a value that increments every microsecond
+uint32_t microseconds() {
+    return micros();
+}
+
+// Baud rate negotiation hooks.  The Arduino API cannot tell how closely
+// the UART can match a rate, so only rates that 16 MHz AVRs generate
+// within about 2% are accepted.  Line errors are not reported by the API.
+bool expander_baud_supported(uint32_t baud) {
+    static const uint32_t rates[] = { 115200, 250000, 500000, 1000000, 2000000 };
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (rates[i] == baud) {
+            return baud <= FNC_MAX_BAUD;
+        }
+    }
+    return false;
+}
+void expander_set_baud(uint32_t baud) {
+    FNCSerial.flush();  // Wait for the ACK to be sent
+    FNCSerial.begin(baud ? baud : FNC_BAUD);
+}
+
 // Perform extra operations after the normal polling for input from FluidNC
 void poll_extra() {
 #ifdef DebugSerial
@@ -41,12 +67,10 @@ void poll_extra() {
 }
 
 void setup() {
-    init_gpiomap();
-
 #ifdef LEDPBUILTIN
     pinMode(LED_BUILTIN, OUTPUT);
 #endif
-    FNCSerial.begin(115200);
+    FNCSerial.begin(FNC_BAUD);
 #ifdef DebugSerial
     DebugSerial.begin(115200);
 #endif
@@ -7,6 +7,7 @@
 #include "pwm_pin.h"
 #include "gpio_pin.h"
 #include "dma_uart.h"
+#include "pool.h"
 #include "system.h"
 #include "gpiomap.h"
 #ifdef STARTUP_DEBUG
@@ -15,10 +16,7 @@
 #    define GL set_output(DEBUG_PIN, 0, 0);
 #endif
 
-int pass_getchar() {
-    return dma_getchar(1);
-}
-
+#ifndef NO_PASSTHROUGH
 void pass_print(const char* msg) {
     dma_print(1, msg);
 }
@@ -27,6 +25,7 @@ void pass_println(const char* msg) {
     pass_print(msg);
     pass_print("\n");
 }
+#endif
 
 // Interface routines for GrblParser
 
@@ -45,14 +44,268 @@ int milliseconds() {
     return HAL_GetTick();
 }
 
-// Perform extra operations after the normal polling for input from FluidNC
-void poll_extra() {
-    int c;
-    while ((c = pass_getchar()) != -1) {
-        if (c != '\0') {  // Suppress nulls that can be caused by pendant startup messages at the wrong baud rate
-            fnc_putchar(c);
+// Return a free-running microsecond count, interpolated from SysTick
+uint32_t microseconds() {
+    uint32_t ms, ticks;
+    do {
+        ms    = HAL_GetTick();
+        ticks = SysTick->VAL;
+    } while (ms != HAL_GetTick());
+    // When called with interrupts blocked, SysTick may have wrapped
+    // without HAL_IncTick() having run yet
+    if ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) && ticks > SysTick->LOAD / 2) {
+        ++ms;
+    }
+    uint32_t load = SysTick->LOAD + 1;
+    return ms * 1000 + (load - ticks) * 1000 / load;
+}
+
+// Return the CPU cycle counter, used for measuring command parsing cost
+uint32_t expander_cycles() {
+    return DWT->CYCCNT;
+}
+
+// Turn on the inverted output of a PWM pin's timer channel
+bool expander_complementary(uint8_t pin_num, uint32_t deadtime_ns, uint8_t brk) {
+    if (pin_num >= n_pins || !gpios[pin_num].initialized || gpios[pin_num].type != pin_type_PWM) {
+        return false;
+    }
+    return PWM_Complementary(&gpio_map[pin_num], deadtime_ns, brk);
+}
+
+// Ramp a PWM pin with the timer's update DMA
+bool expander_ramp(uint8_t pin_num, uint32_t numerator, uint32_t denominator, uint32_t ms, uint8_t curve) {
+    if (pin_num >= n_pins || !gpios[pin_num].initialized || gpios[pin_num].type != pin_type_PWM) {
+        return false;
+    }
+    return PWM_Ramp(&gpio_map[pin_num], numerator, denominator, ms, curve);
+}
+
+// Make a PWM pin a servo output with travel and slew limits
+bool expander_servo(uint8_t pin_num, uint16_t min_us, uint16_t max_us, uint32_t slew) {
+    if (pin_num >= n_pins || !gpios[pin_num].initialized || gpios[pin_num].type != pin_type_PWM) {
+        return false;
+    }
+    return PWM_Servo(&gpio_map[pin_num], min_us, max_us, slew);
+}
+
+// Move a servo pin to a pulse width in microseconds
+bool expander_servo_move(uint8_t pin_num, uint16_t pulse_us) {
+    if (pin_num >= n_pins || !gpios[pin_num].initialized || gpios[pin_num].type != pin_type_PWM) {
+        return false;
+    }
+    return PWM_Servo_Move(&gpio_map[pin_num], pulse_us);
+}
+
+// Report the PWM frequency and resolution that the timer achieved
+bool expander_pwm_info(uint8_t pin_num, uint32_t* frequency, uint32_t* steps) {
+    if (pin_num >= n_pins || !(gpio_map[pin_num].capabilities & PWM)) {
+        return false;
+    }
+    return PWM_Info(&gpio_map[pin_num], frequency, steps);
+}
+
+// Report the pin whose timer channel a PWM pin could not share
+bool expander_pin_conflict(uint8_t pin_num, uint8_t* other_pin, uint32_t* frequency) {
+    if (pin_num >= n_pins || !(gpio_map[pin_num].capabilities & PWM)) {
+        return false;
+    }
+    return PWM_Conflict(&gpio_map[pin_num], other_pin, frequency);
+}
+
+// Baud rate negotiation hooks for the link to FluidNC.  USART1 runs
+// from the 60 MHz APB2 clock, so it can go up to 3.75 Mbaud.
+bool expander_baud_supported(uint32_t baud) {
+    return dma_uart_baud_ok(0, baud);
+}
+void expander_set_baud(uint32_t baud) {
+    dma_uart_set_baud(0, baud ? baud : FNC_BAUD);
+}
+uint32_t expander_link_errors() {
+    dma_uart_stats_t stats;
+    dma_uart_stats(0, &stats);
+    return stats.overrun_errors + stats.framing_errors + stats.noise_errors;
+}
+
+#ifndef NO_PASSTHROUGH
+// Pass-through data goes to FluidNC straight from the USART2 receive
+// ring, as USART1 transmit DMA transfers.  The bytes of a transfer stay
+// in the ring until it is done.  Other output to FluidNC, such as
+// expander reports, is sent between transfers, so limiting their length
+// limits how long that output can be delayed.
+#define BRIDGE_SPAN_MAX 256
+
+static int bridge_len = 0;  // Length of the transfer in progress
+
+// GRBL realtime commands from the pass-through port are sent ahead of
+// the line data that is waiting in the receive ring.  The unread data
+// is scanned as soon as it arrives, and each realtime byte is queued in
+// the USART1 transmit ring, which goes out before the next pass-through
+// transfer, and is then replaced by a null that the bridge skips.  Its
+// delay is bounded by the transfer in progress, at most BRIDGE_SPAN_MAX
+// bytes, plus the other output already queued for FluidNC.
+static int     scanned        = 0;  // Unread pass-through bytes that have been scanned
+static uint8_t utf8_remaining = 0;  // Continuation bytes expected in a UTF-8 sequence
+
+// Realtime latency, from detection until the transmitter has sent the byte
+static bool     rt_pending = false;
+static uint16_t rt_position;
+static uint32_t rt_start;
+static uint32_t rt_count   = 0;
+static uint32_t rt_total   = 0;
+static uint32_t rt_max     = 0;
+
+// Bytes 0x80-0xBF that are not part of a UTF-8 sequence are the single
+// byte realtime commands, such as feed overrides and safety door
+static bool is_realtime(uint8_t c) {
+    if (utf8_remaining) {
+        if ((c & 0xc0) == 0x80) {
+            --utf8_remaining;
+            return false;
         }
+        utf8_remaining = 0;
+    }
+    if (c >= 0xc0) {
+        utf8_remaining = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+        return false;
     }
+    return c >= 0x80 || c == '?' || c == '!' || c == '~' || c == 0x18;
+}
+
+static void scan_realtime(dma_span_t spans[2], int unread) {
+    for (; scanned < unread; scanned++) {
+        int      i = scanned;
+        int      s = i < spans[0].len ? 0 : 1;
+        uint8_t* p = (uint8_t*)&spans[s].data[s ? i - spans[0].len : i];  // The ring is in RAM
+        if (!is_realtime(*p)) {
+            continue;
+        }
+        if (!dma_write(0, p, 1)) {
+            return;  // Try again when there is room
+        }
+        *p = '\0';
+        if (!rt_pending) {
+            rt_pending  = true;
+            rt_position = dma_tx_position(0);
+            rt_start    = microseconds();
+        }
+    }
+}
+
+static void measure_realtime() {
+    if (rt_pending && dma_tx_reached(0, rt_position)) {
+        uint32_t latency = microseconds() - rt_start;
+        rt_pending       = false;
+        ++rt_count;
+        rt_total += latency;
+        if (latency > rt_max) {
+            rt_max = latency;
+        }
+    }
+}
+
+// Release bytes at the start of the pass-through ring
+static void bridge_consume(int len) {
+    dma_consume(1, len);
+    scanned = scanned > len ? scanned - len : 0;
+}
+
+static void bridge_passthrough() {
+    if (bridge_len && !dma_tx_busy(0)) {
+        bridge_consume(bridge_len);
+        bridge_len = 0;
+    }
+
+    dma_span_t spans[2];
+    uint32_t   overruns = dma_rx_overruns(1);
+    int        unread   = dma_read_spans(1, spans);
+    if (dma_rx_overruns(1) != overruns) {
+        // The ring overran and its unread data was discarded, including
+        // any span still being sent, so none of it can be consumed later,
+        // and a UTF-8 sequence being scanned was cut off
+        bridge_len     = 0;
+        scanned        = 0;
+        utf8_remaining = 0;
+    }
+    scan_realtime(spans, unread);
+    if (bridge_len || !unread) {
+        return;
+    }
+    // Only the first span is used; the one after the wrap is picked up next time
+    const uint8_t* data = spans[0].data;
+    int            len  = spans[0].len;
+
+    // Suppress nulls that can be caused by pendant startup messages at the wrong baud rate
+    int nulls = 0;
+    while (nulls < len && data[nulls] == '\0') {
+        ++nulls;
+    }
+    if (nulls) {
+        bridge_consume(nulls);
+        data += nulls;
+        len -= nulls;
+    }
+
+    // Only bytes that have been scanned for realtime commands are sent
+    if (len > scanned) {
+        len = scanned;
+    }
+    int run = 0;
+    while (run < len && run < BRIDGE_SPAN_MAX && data[run] != '\0') {
+        ++run;
+    }
+    if (run && dma_send_span(0, data, run)) {
+        bridge_len = run;
+    }
+}
+#endif
+
+#ifdef NO_PASSTHROUGH
+#    define N_UARTS 1
+#else
+#    define N_UARTS 2
+#endif
+
+extern volatile uint32_t gpio_event_overflows;
+
+// Report the UART counters, lost pin events, and unused buffer pool
+// space in response to [EXP:STATS]
+void expander_report_app_stats() {
+    static const char* const uart_keys[]  = { "RX", "TX", "PEAK", "OVR", "ORE", "FE", "NE" };
+    static const char* const uart_names[] = { "FNC", "PASS" };
+    for (int uart_num = 0; uart_num < N_UARTS; uart_num++) {
+        dma_uart_stats_t stats;
+        dma_uart_stats(uart_num, &stats);
+        uint32_t values[] = { stats.rx_bytes,       stats.tx_bytes,       stats.rx_peak,     stats.rx_overruns,
+                              stats.overrun_errors, stats.framing_errors, stats.noise_errors };
+        expander_report_values(uart_names[uart_num], uart_keys, values, 7);
+    }
+
+    static const char* const event_keys[] = { "LOST" };
+    uint32_t                 lost         = gpio_event_overflows;
+    expander_report_values("EVENTS", event_keys, &lost, 1);
+
+    static const char* const pool_keys[] = { "FREE" };
+    uint32_t                 pool_free   = pool_available();
+    expander_report_values("POOL", pool_keys, &pool_free, 1);
+
+#ifndef NO_PASSTHROUGH
+    // Realtime latencies in microseconds since the last report
+    static const char* const rt_keys[] = { "N", "AVG", "MAX" };
+    uint32_t                 rt[]      = { rt_count, rt_count ? rt_total / rt_count : 0, rt_max };
+    expander_report_values("RT", rt_keys, rt, 3);
+    rt_count = 0;
+    rt_total = 0;
+    rt_max   = 0;
+#endif
+}
+
+// Perform extra operations after the normal polling for input from FluidNC
+void poll_extra() {
+#ifndef NO_PASSTHROUGH
+    bridge_passthrough();
+    measure_realtime();
+#endif
 
     expander_poll();
 }
@@ -60,7 +313,9 @@ void poll_extra() {
 // Handle IO Expander messages
 void handle_report(char* report) {
     if (!expander_handle_command(report)) {
+#ifndef NO_PASSTHROUGH
         pass_println(report);
+#endif
     }
 }
 
@@ -76,15 +331,20 @@ void delay_ms(uint32_t ms) {
 void setup() {
     HAL_MspInit();
     SystemClock_Config();
+
+    // Start the DWT cycle counter for expander_cycles()
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
     init_from_gpiomap();
+    dma_span_t spans[2];
     init_dma_uart(0, FNC_BAUD, GPIOA, GPIO_PIN_9, GPIOA, GPIO_PIN_10);
-    while (dma_getchar(0) != -1) {
-        // Drain the FluidNC buffer
-    }
+    dma_consume(0, dma_read_spans(0, spans));  // Drain the FluidNC buffer
+#ifndef NO_PASSTHROUGH
     init_dma_uart(1, PASSTHROUGH_BAUD, GPIOA, GPIO_PIN_2, GPIOA, GPIO_PIN_3);
-    while (dma_getchar(1) != -1) {
-        // Drain the pass-through buffer
-    }
+    dma_consume(1, dma_read_spans(1, spans));  // Drain the pass-through buffer
+#endif
 
 #ifdef STARTUP_DEBUG
     set_pin_mode(DEBUG_PIN, PIN_OUTPUT);
@@ -101,10 +361,38 @@ void setup() {
     fnc_wait_ready();
 }
 
+// True if the main loop has work that no interrupt will announce
+static bool work_pending() {
+    if (dma_rx_pending(0) || gpio_events_pending()) {
+        return true;
+    }
+#ifdef NO_PASSTHROUGH
+    return false;
+#else
+    // While pass-through data is being sent, its DMA completion interrupt
+    // is the next event of interest
+    return bridge_len ? !dma_tx_busy(0) : dma_rx_pending(1);
+#endif
+}
+
+// Sleep until an interrupt arrives: received data from the DMA half and
+// full points or a USART idle line, a pin edge, a DMA transmit
+// completion, or the 1 ms SysTick that drives debouncing and polled
+// inputs.  Interrupts are disabled around the check so an event that
+// arrives just before WFI still ends the sleep.
+static void wait_for_event() {
+    __disable_irq();
+    if (!work_pending()) {
+        __WFI();
+    }
+    __enable_irq();
+}
+
 int main() {
     setup();
     while (1) {
         fnc_poll();
+        wait_for_event();
     }
     return 0;
 }
@@ -9,34 +9,41 @@ const char* board_name = "Airedale v1.1";
 // device-specific and board-specific pin numbers
 
 // clang-format off
-pin_t gpios[] = {
-    //          port   num        capabilities TIM ch     io_num  usage
-    { .gpio = { GPIOA, GPIO_PIN_4,  IN|PU|PD,   0, 0 } }, //   0  I0
-    { .gpio = { GPIOA, GPIO_PIN_5,  IN|PU|PD,   0, 0 } }, //   1  I1
-    { .gpio = { GPIOB, GPIO_PIN_0,  IN|PU|PD,   3, 3 } }, //   2  I2
-    { .gpio = { GPIOB, GPIO_PIN_10, IN|PU|PD,   2, 3 } }, //   3  I3
-    { .gpio = { GPIOA, GPIO_PIN_12, IN|PU|PD,   0, 0 } }, //   4  I4
-    { .gpio = { GPIOB, GPIO_PIN_14, IN|PU|PD,   0, 0 } }, //   5  I5
-    { .gpio = { GPIOB, GPIO_PIN_12, IN|PU|PD,   0, 0 } }, //   6  I6
-    { .gpio = { GPIOB, GPIO_PIN_13, IN|PU|PD,   0, 0 } }, //   7  I7
-    { .gpio = { GPIOA, GPIO_PIN_8,  OUT|PWM,    1, 1 } }, //   8  O0
-    { .gpio = { GPIOA, GPIO_PIN_0,  OUT|PWM,    2, 1 } }, //   9  O1
-    { .gpio = { GPIOA, GPIO_PIN_6,  OUT|PWM,    3, 1 } }, //  10  O2
-    { .gpio = { GPIOB, GPIO_PIN_6,  OUT|PWM,    4, 1 } }, //  11  O3
-    { .gpio = { GPIOA, GPIO_PIN_11, OUT|PWM,    1, 4 } }, //  12  O4
-    { .gpio = { GPIOB, GPIO_PIN_11, OUT|PWM,    2, 4 } }, //  13  O5
-    { .gpio = { GPIOB, GPIO_PIN_1,  OUT|PWM,    3, 4 } }, //  14  O6
-    { .gpio = { GPIOB, GPIO_PIN_9,  OUT|PWM,    4, 4 } }, //  15  O7
-    { .gpio = { GPIOA, GPIO_PIN_1,  OUT|PWM,    2, 2 } }, //  16  FET0
-    { .gpio = { GPIOA, GPIO_PIN_7,  OUT|PWM,    3, 2 } }, //  17  FET1
-    { .gpio = { GPIOB, GPIO_PIN_5,  OUT,        0, 0 } }, //  18  RGB_LED RED
-    { .gpio = { GPIOB, GPIO_PIN_4,  OUT,        0, 0 } }, //  19  RGB_LED GREEN
-    { .gpio = { GPIOB, GPIO_PIN_3,  OUT,        0, 0 } }, //  20  RGB_LED BLUE
+const gpio_pin_t gpio_map[] = {
+    // port  num          capabilities TIM ch  remaps             alternate route                            io_num  usage
+    { GPIOA, GPIO_PIN_4,  IN|PU|PD,   0, 0 },                                                     //   0  I0
+    { GPIOA, GPIO_PIN_5,  IN|PU|PD,   0, 0 },                                                     //   1  I1
+    { GPIOB, GPIO_PIN_0,  IN|PU|PD,   3, 3, TIM_MAP0|TIM_MAP2 },                                  //   2  I2
+    { GPIOB, GPIO_PIN_10, IN|PU|PD,   2, 3, TIM_MAP2|TIM_MAP3 },                                  //   3  I3
+    { GPIOA, GPIO_PIN_12, IN|PU|PD,   0, 0 },                                                     //   4  I4
+    { GPIOB, GPIO_PIN_14, IN|PU|PD,   0, 0 },                                                     //   5  I5
+    { GPIOB, GPIO_PIN_12, IN|PU|PD,   0, 0 },                                                     //   6  I6
+    { GPIOB, GPIO_PIN_13, IN|PU|PD,   0, 0 },                                                     //   7  I7
+    { GPIOA, GPIO_PIN_8,  OUT|PWM,    1, 1, TIM_MAP0|TIM_MAP1 },                                  //   8  O0
+    { GPIOA, GPIO_PIN_0,  OUT|PWM,    2, 1, TIM_MAP0|TIM_MAP2 },                                  //   9  O1
+    { GPIOA, GPIO_PIN_6,  OUT|PWM,    3, 1, TIM_MAP0 },                                           //  10  O2
+    { GPIOB, GPIO_PIN_6,  OUT|PWM,    4, 1, TIM_MAP0 },                                           //  11  O3
+    { GPIOA, GPIO_PIN_11, OUT|PWM,    1, 4, TIM_MAP0|TIM_MAP1 },                                  //  12  O4
+    { GPIOB, GPIO_PIN_11, OUT|PWM,    2, 4, TIM_MAP2|TIM_MAP3 },                                  //  13  O5
+    { GPIOB, GPIO_PIN_1,  OUT|PWM,    3, 4, TIM_MAP0|TIM_MAP2, .alt = { 1, 3, TIM_MAP1, true } }, //  14  O6
+    { GPIOB, GPIO_PIN_9,  OUT|PWM,    4, 4, TIM_MAP0 },                                           //  15  O7
+    { GPIOA, GPIO_PIN_1,  OUT|PWM,    2, 2, TIM_MAP0|TIM_MAP2 },                                  //  16  FET0
+    { GPIOA, GPIO_PIN_7,  OUT|PWM,    3, 2, TIM_MAP0,          .alt = { 1, 1, TIM_MAP1, true } }, //  17  FET1
+    { GPIOB, GPIO_PIN_5,  OUT|PWM,    3, 2, TIM_MAP2 },                                           //  18  RGB_LED RED
+    { GPIOB, GPIO_PIN_4,  OUT|PWM,    3, 1, TIM_MAP2 },                                           //  19  RGB_LED GREEN
+    { GPIOB, GPIO_PIN_3,  OUT|PWM,    2, 2, TIM_MAP1|TIM_MAP3 },                                  //  20  RGB_LED BLUE
 };
-// PB3, PB4, and PB5 can do PWM but it requires AF remapping which we
-// do not support
+// PB3, PB4, and PB5 are freed from JTAG by HAL_MspInit().  Using them
+// for PWM needs a TIM2 or TIM3 remap that moves the O1/FET0 or O2/FET1
+// channels off their pins, so they cannot be PWM at the same time as
+// those outputs.  O5 needs the TIM2 partial 2 remap.  O6 and FET1 can
+// also run from TIM1 CH3N and CH1N with the TIM1 partial remap when TIM3
+// is busy at another frequency; FET1 then keeps O0 from
+// using TIM1 CH1.
 
-const int n_pins = sizeof(gpios) / sizeof(gpios[0]);
+const int n_pins = sizeof(gpio_map) / sizeof(gpio_map[0]);
+
+pin_t gpios[sizeof(gpio_map) / sizeof(gpio_map[0])];
 
 #define RED_LED 18
 #define GREEN_LED 19
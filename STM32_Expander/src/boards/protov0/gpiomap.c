@@ -7,28 +7,30 @@
 // device-specific and board-specific pin numbers
 
 // clang-format off
-pin_t gpios[] = {
-    //          port   num          capabilities   io_num
-    { .gpio = { GPIOA, GPIO_PIN_4,  IN|PU|PD } },  //   0
-    { .gpio = { GPIOA, GPIO_PIN_5,  IN|PU|PD } },  //   1
-    { .gpio = { GPIOA, GPIO_PIN_8,  OUT|PWM  } },  //   2
-    { .gpio = { GPIOA, GPIO_PIN_11, IN|PU|PD } },  //   3
-    { .gpio = { GPIOA, GPIO_PIN_12, IN|PU|PD } },  //   4
-    { .gpio = { GPIOB, GPIO_PIN_6,  OUT|PWM  } },  //   5
-    { .gpio = { GPIOB, GPIO_PIN_7,  OUT|PWM  } },  //   6
-    { .gpio = { GPIOB, GPIO_PIN_8,  OUT|PWM  } },  //   7
-    { .gpio = { GPIOB, GPIO_PIN_9,  OUT|PWM  } },  //   8
-    { .gpio = { GPIOB, GPIO_PIN_10, IN|PU|PD } },  //   9
-    { .gpio = { GPIOB, GPIO_PIN_11, IN|PU|PD } },  //  10
-    { .gpio = { GPIOB, GPIO_PIN_14, IN|PU|PD } },  //  11
-    { .gpio = { GPIOB, GPIO_PIN_15, IN|PU|PD } },  //  12
-    { .gpio = { GPIOC, GPIO_PIN_13, IN|PU|PD } },  //  13
-    { .gpio = { GPIOA, GPIO_PIN_0,  OUT|PWM  } },  //  14
-    { .gpio = { GPIOA, GPIO_PIN_1,  OUT|PWM  } },  //  15
-    { .gpio = { GPIOA, GPIO_PIN_6,  OUT|PWM  } },  //  16
-    { .gpio = { GPIOA, GPIO_PIN_7,  OUT|PWM  } },  //  17
-    { .gpio = { GPIOB, GPIO_PIN_0,  OUT|PWM  } },  //  18
-    { .gpio = { GPIOB, GPIO_PIN_1,  OUT|PWM  } },  //  19
+const gpio_pin_t gpio_map[] = {
+    // port  num          capabilities    io_num
+    { GPIOA, GPIO_PIN_4,  IN|PU|PD },  //   0
+    { GPIOA, GPIO_PIN_5,  IN|PU|PD },  //   1
+    { GPIOA, GPIO_PIN_8,  OUT|PWM  },  //   2
+    { GPIOA, GPIO_PIN_11, IN|PU|PD },  //   3
+    { GPIOA, GPIO_PIN_12, IN|PU|PD },  //   4
+    { GPIOB, GPIO_PIN_6,  OUT|PWM  },  //   5
+    { GPIOB, GPIO_PIN_7,  OUT|PWM  },  //   6
+    { GPIOB, GPIO_PIN_8,  OUT|PWM  },  //   7
+    { GPIOB, GPIO_PIN_9,  OUT|PWM  },  //   8
+    { GPIOB, GPIO_PIN_10, IN|PU|PD },  //   9
+    { GPIOB, GPIO_PIN_11, IN|PU|PD },  //  10
+    { GPIOB, GPIO_PIN_14, IN|PU|PD },  //  11
+    { GPIOB, GPIO_PIN_15, IN|PU|PD },  //  12
+    { GPIOC, GPIO_PIN_13, IN|PU|PD },  //  13
+    { GPIOA, GPIO_PIN_0,  OUT|PWM  },  //  14
+    { GPIOA, GPIO_PIN_1,  OUT|PWM  },  //  15
+    { GPIOA, GPIO_PIN_6,  OUT|PWM  },  //  16
+    { GPIOA, GPIO_PIN_7,  OUT|PWM  },  //  17
+    { GPIOB, GPIO_PIN_0,  OUT|PWM  },  //  18
+    { GPIOB, GPIO_PIN_1,  OUT|PWM  },  //  19
 };
 
-const int n_pins = sizeof(gpios) / sizeof(gpios[0]);
+const int n_pins = sizeof(gpio_map) / sizeof(gpio_map[0]);
+
+pin_t gpios[sizeof(gpio_map) / sizeof(gpio_map[0])];
@@ -1,53 +1,176 @@
 // Copyright (c) 2025 Mitch Bradley
 // Use of this source code is governed by a GPLv3 license that can be found in the LICENSE file.
 
-// STM32 UART driver using DMA for reception
+// STM32 UART driver using DMA for reception and transmission
 
 #include "gpio_pin.h"  // gpio_clock_enable()
 #include "dma_uart.h"
+#include "pool.h"
+#include "system.h"  // Error_Handler()
 #include <string.h>
 
-// DMA ring buffers
-#define UART1_DMA_LEN 4096
-uint8_t uart1_dma_buf[UART1_DMA_LEN];
-
-#define UART2_DMA_LEN 4096
-uint8_t uart2_dma_buf[UART2_DMA_LEN];
-
 typedef struct {
-    UART_HandleTypeDef huart;
+    UART_HandleTypeDef huart;  // Must be first; see tx_done()
     DMA_HandleTypeDef  hdma;
-    int                last_dma_count;
-    int                dma_len;
+    int                dma_len;  // From pool.h, allocated by init_dma_uart()
     uint8_t*           dma_buf;
+    int                rx_pos;     // Index of the next byte to read
+    int                rx_cached;  // Bytes known to be readable at rx_pos
+    uint32_t           rx_read;    // Total bytes read
+
+    // The receive DMA interrupts each time it fills half of the ring, so
+    // the count of those interrupts tells how far the DMA has gone in
+    // total, and a reader that is more than a ring behind can be detected.
+    volatile uint32_t rx_halves;
+
+    dma_uart_stats_t stats;
+
+    // The main loop adds bytes at tx_head and the DMA completion
+    // interrupt retires them at tx_tail.  Both are free-running
+    // counters, so head - tail is the number of bytes queued.
+    DMA_HandleTypeDef hdma_tx;
+    uint8_t*          tx_buf;
+    uint16_t          tx_len;
+    volatile uint16_t tx_head;
+    volatile uint16_t tx_tail;
+    volatile uint16_t tx_sending;  // Length of the DMA transfer in progress, 0 if idle
+    volatile bool     tx_span;     // The transfer is from a caller's span, not the ring
+
+    const uart_flow_t* flow;
+    volatile bool      rts_stopped;  // RTS is telling the peer to stop
 } dma_uart_t;
 
 dma_uart_t dma_uarts[2] = {
-    { .huart = { .Instance = USART1 }, .last_dma_count = UART1_DMA_LEN, .dma_len = UART1_DMA_LEN, .dma_buf = uart1_dma_buf },
-    { .huart = { .Instance = USART2 }, .last_dma_count = UART2_DMA_LEN, .dma_len = UART2_DMA_LEN, .dma_buf = uart2_dma_buf },
+    { .huart = { .Instance = USART1 }, .dma_len = FNC_RX_LEN, .tx_len = FNC_TX_LEN },
+    { .huart = { .Instance = USART2 }, .dma_len = PASS_RX_LEN, .tx_len = PASS_TX_LEN },
 };
 
+const uart_flow_t __attribute__((weak)) uart_flow[2] = { { NULL }, { NULL } };
+
+// RTS tells the peer to stop when the receive ring is 3/4 full, and
+// to resume when it has drained to 1/4, leaving room for the bytes the
+// peer sends before it reacts.  The receive interrupts only look at the
+// fill level each half ring, and at the end of a burst, so they stop the
+// peer at 1/2 full; the next half interrupt comes before an overrun.
+#define RTS_STOP_LEVEL(len) ((len) * 3 / 4)
+#define RTS_IRQ_STOP_LEVEL(len) ((len) / 2)
+#define RTS_START_LEVEL(len) ((len) / 4)
+
+// Called from the main loop after reads and from the receive interrupts,
+// with the stop level for the caller
+static void update_rts(dma_uart_t* dma_uart, uint32_t unread, uint32_t stop_level) {
+    const uart_flow_t* flow = dma_uart->flow;
+    if (!flow->rts_port) {
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!dma_uart->rts_stopped && unread >= stop_level) {
+        dma_uart->rts_stopped = true;
+        flow->rts_port->BSRR  = flow->rts_pin;
+    } else if (dma_uart->rts_stopped && unread <= RTS_START_LEVEL((uint32_t)dma_uart->dma_len)) {
+        dma_uart->rts_stopped = false;
+        flow->rts_port->BSRR  = (uint32_t)flow->rts_pin << 16;
+    }
+    __set_PRIMASK(primask);
+}
+
+// Start a transmit DMA transfer.  TC is cleared first, since it stays
+// set from the idle time before the transfer, so that dma_flush() can
+// tell when the last byte of this transfer has left the shift register.
+static void tx_start(dma_uart_t* dma_uart, const uint8_t* data, uint16_t count) {
+    dma_uart->tx_sending = count;
+    __HAL_UART_CLEAR_FLAG(&dma_uart->huart, UART_FLAG_TC);
+    HAL_DMA_Start_IT(&dma_uart->hdma_tx, (uint32_t)data, (uint32_t)&dma_uart->huart.Instance->DR, count);
+}
+
+// Start a DMA transfer of the queued bytes, up to the end of the ring,
+// if none is in progress.  Called with interrupts disabled or from the
+// DMA interrupt.
+static void tx_kick(dma_uart_t* dma_uart) {
+    if (dma_uart->tx_sending) {
+        return;
+    }
+    uint16_t count = dma_uart->tx_head - dma_uart->tx_tail;
+    if (!count) {
+        return;
+    }
+    uint16_t offset = dma_uart->tx_tail & (dma_uart->tx_len - 1);
+    if (count > dma_uart->tx_len - offset) {
+        count = dma_uart->tx_len - offset;
+    }
+    tx_start(dma_uart, &dma_uart->tx_buf[offset], count);
+}
+
+// DMA transfer complete or error callback.  A transfer that failed is
+// dropped rather than retried, so a bad channel cannot wedge the ring.
+static void tx_done(DMA_HandleTypeDef* hdma) {
+    // Parent points to huart, which is the first member of dma_uart_t
+    dma_uart_t* dma_uart = (dma_uart_t*)hdma->Parent;
+    if (hdma->ErrorCode == HAL_DMA_ERROR_NONE) {
+        dma_uart->stats.tx_bytes += dma_uart->tx_sending;
+    }
+    if (dma_uart->tx_span) {
+        dma_uart->tx_span = false;
+    } else {
+        dma_uart->tx_tail += dma_uart->tx_sending;
+    }
+    dma_uart->tx_sending = 0;
+    tx_kick(dma_uart);
+}
+
 void init_dma_uart(int uart_num, int baud, GPIO_TypeDef* tx_port, uint16_t tx_pin, GPIO_TypeDef* rx_port, uint16_t rx_pin) {
     dma_uart_t* dma_uart = &dma_uarts[uart_num];
 
+    if (!dma_uart->dma_len || !dma_uart->tx_len) {
+        // Not configured in this build.  A zero dma_len makes the other
+        // functions do nothing, since the UART is never set up.
+        dma_uart->dma_len = 0;
+        dma_uart->tx_len  = 0;
+        return;
+    }
+    if (!dma_uart->dma_buf) {
+        dma_uart->dma_buf = pool_alloc(dma_uart->dma_len);
+        dma_uart->tx_buf  = pool_alloc(dma_uart->tx_len);
+        if (!dma_uart->dma_buf || !dma_uart->tx_buf) {
+            Error_Handler();
+        }
+    }
+
     UART_HandleTypeDef* huart = &(dma_uart->huart);
 
     __HAL_RCC_DMA1_CLK_ENABLE();
 
-    DMA_HandleTypeDef* hdma = &(dma_uart->hdma);
+    DMA_HandleTypeDef* hdma    = &(dma_uart->hdma);
+    DMA_HandleTypeDef* hdma_tx = &(dma_uart->hdma_tx);
+    IRQn_Type          uart_irqn;
+    GPIO_TypeDef*      cts_port;
+    uint16_t           cts_pin;
 
     switch (uart_num) {
         case 0:
             __HAL_RCC_USART1_CLK_ENABLE();
+            uart_irqn      = USART1_IRQn;
+            cts_port       = GPIOA;
+            cts_pin        = GPIO_PIN_11;
             hdma->Instance = DMA1_Channel5;
             HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
             HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+            hdma_tx->Instance = DMA1_Channel4;
+            HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+            HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
             break;
         case 1:
             __HAL_RCC_USART2_CLK_ENABLE();
+            uart_irqn      = USART2_IRQn;
+            cts_port       = GPIOA;
+            cts_pin        = GPIO_PIN_0;
             hdma->Instance = DMA1_Channel6;
             HAL_NVIC_SetPriority(DMA1_Channel6_IRQn, 0, 0);
             HAL_NVIC_EnableIRQ(DMA1_Channel6_IRQn);
+            hdma_tx->Instance = DMA1_Channel7;
+            HAL_NVIC_SetPriority(DMA1_Channel7_IRQn, 0, 0);
+            HAL_NVIC_EnableIRQ(DMA1_Channel7_IRQn);
             break;
         default:
             return;
@@ -68,12 +191,32 @@ void init_dma_uart(int uart_num, int baud, GPIO_TypeDef* tx_port, uint16_t tx_pi
     gpiomode.Pull = GPIO_NOPULL;
     HAL_GPIO_Init(rx_port, &gpiomode);
 
+    const uart_flow_t* flow = &uart_flow[uart_num];
+    dma_uart->flow          = flow;
+    dma_uart->rts_stopped   = false;
+    if (flow->rts_port) {
+        gpio_clock_enable(flow->rts_port);
+        HAL_GPIO_WritePin(flow->rts_port, flow->rts_pin, GPIO_PIN_RESET);
+        gpiomode.Pin  = flow->rts_pin;
+        gpiomode.Mode = GPIO_MODE_OUTPUT_PP;
+        gpiomode.Pull = GPIO_NOPULL;
+        HAL_GPIO_Init(flow->rts_port, &gpiomode);
+    }
+    if (flow->cts) {
+        // Pulled low so an unconnected CTS does not block transmission
+        gpio_clock_enable(cts_port);
+        gpiomode.Pin  = cts_pin;
+        gpiomode.Mode = GPIO_MODE_INPUT;
+        gpiomode.Pull = GPIO_PULLDOWN;
+        HAL_GPIO_Init(cts_port, &gpiomode);
+    }
+
     huart->Init.BaudRate     = baud;
     huart->Init.WordLength   = UART_WORDLENGTH_8B;
     huart->Init.StopBits     = UART_STOPBITS_1;
     huart->Init.Parity       = UART_PARITY_NONE;
     huart->Init.Mode         = UART_MODE_TX_RX;
-    huart->Init.HwFlowCtl    = UART_HWCONTROL_NONE;
+    huart->Init.HwFlowCtl    = flow->cts ? UART_HWCONTROL_CTS : UART_HWCONTROL_NONE;
     huart->Init.OverSampling = UART_OVERSAMPLING_16;
     if (HAL_UART_Init(huart) != HAL_OK) {
         return;
@@ -95,35 +238,281 @@ void init_dma_uart(int uart_num, int baud, GPIO_TypeDef* tx_port, uint16_t tx_pi
     hdma->Parent  = huart;
     // __HAL_LINKDMA(huart, hdmarx, hdma);
 
-    dma_uart->last_dma_count = dma_uart->dma_len;
+    dma_uart->rx_pos    = 0;
+    dma_uart->rx_cached = 0;
+    dma_uart->rx_read   = 0;
+    dma_uart->rx_halves = 0;
+    memset(&dma_uart->stats, 0, sizeof(dma_uart->stats));
     HAL_UART_Receive_DMA(huart, dma_uart->dma_buf, dma_uart->dma_len);
+
+    // The receive DMA interrupts at the half and full points of the ring,
+    // and the USART interrupts when the line goes idle after a burst.
+    // Those interrupts only need to wake the main loop from WFI.
+    // HAL_UART_Receive_DMA() also enabled the error interrupts, which
+    // the same handler clears.
+    __HAL_UART_CLEAR_IDLEFLAG(huart);
+    __HAL_UART_ENABLE_IT(huart, UART_IT_IDLE);
+    HAL_NVIC_SetPriority(uart_irqn, 0, 0);
+    HAL_NVIC_EnableIRQ(uart_irqn);
+
+    // The transmit channel is driven directly instead of through
+    // HAL_UART_Transmit_DMA(), which would need the USART interrupt
+    // and would refuse to start while a previous transfer is active.
+    hdma_tx->Init.Direction           = DMA_MEMORY_TO_PERIPH;
+    hdma_tx->Init.PeriphInc           = DMA_PINC_DISABLE;
+    hdma_tx->Init.MemInc              = DMA_MINC_ENABLE;
+    hdma_tx->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_tx->Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+    hdma_tx->Init.Mode                = DMA_NORMAL;
+    hdma_tx->Init.Priority            = DMA_PRIORITY_MEDIUM;
+    if (HAL_DMA_Init(hdma_tx) != HAL_OK) {
+        return;
+    }
+    hdma_tx->Parent            = huart;
+    hdma_tx->XferCpltCallback  = tx_done;
+    hdma_tx->XferErrorCallback = tx_done;
+
+    dma_uart->tx_head    = 0;
+    dma_uart->tx_tail    = 0;
+    dma_uart->tx_sending = 0;
+    dma_uart->tx_span    = false;
+    SET_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+}
+
+// Queue up to len bytes for transmission without waiting.  Returns the
+// number of bytes queued, which is less than len if the ring is full.
+int dma_write(int uart_num, const uint8_t* data, int len) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    if (!dma_uart->dma_len) {
+        return 0;
+    }
+
+    uint16_t head  = dma_uart->tx_head;
+    uint16_t space = dma_uart->tx_len - (uint16_t)(head - dma_uart->tx_tail);
+    if (len > space) {
+        len = space;
+    }
+    if (!len) {
+        return 0;
+    }
+    uint16_t offset = head & (dma_uart->tx_len - 1);
+    uint16_t first  = dma_uart->tx_len - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(&dma_uart->tx_buf[offset], data, first);
+    memcpy(dma_uart->tx_buf, data + first, len - first);
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    dma_uart->tx_head = head + len;
+    tx_kick(dma_uart);
+    __set_PRIMASK(primask);
+    return len;
+}
+// Transmit len bytes directly from data, without copying them into the
+// ring.  The span is only started when the transmitter is idle and the
+// ring is empty, so it can never split bytes that were queued together,
+// and bytes queued while it is sent go out after it.  The data must stay
+// unchanged until dma_tx_busy() returns false.  Returns false if the
+// transmitter is busy.
+bool dma_send_span(int uart_num, const uint8_t* data, int len) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    bool        started  = false;
+
+    if (!dma_uart->dma_len || len <= 0 || len > 0xffff) {
+        return false;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!dma_uart->tx_sending && dma_uart->tx_head == dma_uart->tx_tail) {
+        dma_uart->tx_span = true;
+        tx_start(dma_uart, data, len);
+        started = true;
+    }
+    __set_PRIMASK(primask);
+    return started;
+}
+bool dma_tx_busy(int uart_num) {
+    return dma_uarts[uart_num].tx_sending != 0;
+}
+// A position in the transmit ring just after the bytes queued so far,
+// and whether the transmitter has sent everything before such a position
+uint16_t dma_tx_position(int uart_num) {
+    return dma_uarts[uart_num].tx_head;
+}
+bool dma_tx_reached(int uart_num, uint16_t position) {
+    return (int16_t)(dma_uarts[uart_num].tx_tail - position) >= 0;
+}
+// The number of bytes that dma_write() can accept right now
+int dma_tx_space(int uart_num) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    return dma_uart->tx_len - (uint16_t)(dma_uart->tx_head - dma_uart->tx_tail);
+}
+// Wait until every queued byte, and any span being sent, has left the
+// transmitter
+void dma_flush(int uart_num) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    if (!dma_uart->dma_len) {
+        return;
+    }
+    while (dma_uart->tx_head != dma_uart->tx_tail || dma_uart->tx_sending) {}
+    while (!(dma_uart->huart.Instance->SR & USART_SR_TC)) {}
 }
 
+// dma_print() and dma_putchar() wait only while the ring is full.  On
+// a UART that is not configured they drop the data instead of waiting.
 void dma_print(int uart_num, const char* msg) {
-    HAL_UART_Transmit(&(dma_uarts[uart_num].huart), (uint8_t*)msg, strlen(msg), 1000);
+    const uint8_t* p   = (const uint8_t*)msg;
+    int            len = strlen(msg);
+    if (!dma_uarts[uart_num].dma_len) {
+        return;
+    }
+    while (len) {
+        int n = dma_write(uart_num, p, len);
+        p += n;
+        len -= n;
+    }
 }
 void dma_putchar(int uart_num, uint8_t c) {
-    HAL_UART_Transmit(&(dma_uarts[uart_num].huart), &c, 1, HAL_MAX_DELAY);
+    if (!dma_uarts[uart_num].dma_len) {
+        return;
+    }
+    while (!dma_write(uart_num, &c, 1)) {}
+}
+// The receive DMA half and full transfer callbacks, called by the HAL
+// UART driver for every UART
+static uint32_t rx_written(dma_uart_t* dma_uart, int* write_pos);
+
+// The receive interrupts also check the fill level for RTS, in case the
+// main loop is too busy to read
+static void rx_irq_rts(dma_uart_t* dma_uart) {
+    int write_pos;
+    update_rts(dma_uart, rx_written(dma_uart, &write_pos) - dma_uart->rx_read, RTS_IRQ_STOP_LEVEL((uint32_t)dma_uart->dma_len));
+}
+static void rx_half_done(dma_uart_t* dma_uart) {
+    ++dma_uart->rx_halves;
+    rx_irq_rts(dma_uart);
+}
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef* huart) {
+    rx_half_done((dma_uart_t*)huart);
+}
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef* huart) {
+    rx_half_done((dma_uart_t*)huart);
+}
+
+// Return the total number of bytes that the DMA has received, and
+// the index where it will store the next one
+static uint32_t rx_written(dma_uart_t* dma_uart, int* write_pos) {
+    uint32_t halves;
+    int      pos;
+    do {
+        halves = dma_uart->rx_halves;
+        pos    = dma_uart->dma_len - __HAL_DMA_GET_COUNTER(dma_uart->huart.hdmarx);
+    } while (halves != dma_uart->rx_halves);
+
+    // After an even number of half interrupts the DMA is in the first
+    // half of the ring.  If it is in the other half, it has crossed a
+    // half point whose interrupt has not run yet.
+    int half = dma_uart->dma_len / 2;
+    if ((pos >= half) != (halves & 1)) {
+        ++halves;
+    }
+    *write_pos = pos;
+    return halves * half + pos - (halves & 1) * half;
+}
+
+// The DMA-mode HAL UART driver receives data to a ring buffer, and
+// the readers chase its write position.  dma_read_spans() describes
+// the unread data as up to two contiguous spans, the second one being
+// the part that wrapped to the start of the buffer.  It returns the
+// total length.  The data stays in the buffer until dma_consume().
+// If the DMA has lapped the reader, the unread data has been partly
+// overwritten, so it is discarded and counted as an overrun.
+int dma_read_spans(int uart_num, dma_span_t spans[2]) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    if (!dma_uart->dma_len) {
+        spans[0].len = spans[1].len = 0;
+        return 0;
+    }
+
+    int      write_pos;
+    uint32_t written = rx_written(dma_uart, &write_pos);
+    uint32_t count   = written - dma_uart->rx_read;
+    if (count > (uint32_t)dma_uart->dma_len) {
+        ++dma_uart->stats.rx_overruns;
+        dma_uart->rx_read = written;
+        dma_uart->rx_pos  = write_pos;
+        count             = 0;
+    }
+    if (count > dma_uart->stats.rx_peak) {
+        dma_uart->stats.rx_peak = count;
+    }
+    int first = dma_uart->dma_len - dma_uart->rx_pos;
+    if (first > (int)count) {
+        first = count;
+    }
+    spans[0].data = &dma_uart->dma_buf[dma_uart->rx_pos];
+    spans[0].len  = first;
+    spans[1].data = dma_uart->dma_buf;
+    spans[1].len  = count - first;
+
+    dma_uart->rx_cached = count;
+    update_rts(dma_uart, count, RTS_STOP_LEVEL((uint32_t)dma_uart->dma_len));
+    return count;
+}
+// The number of times dma_read_spans() has discarded unread data, so a
+// reader can tell that spans it was still holding are gone
+uint32_t dma_rx_overruns(int uart_num) {
+    return dma_uarts[uart_num].stats.rx_overruns;
+}
+// Release len bytes that were returned by dma_read_spans()
+void dma_consume(int uart_num, int len) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+
+    if (!dma_uart->dma_len) {
+        return;
+    }
+    if (len > dma_uart->rx_cached) {
+        len = dma_uart->rx_cached;
+    }
+    dma_uart->rx_cached -= len;
+    dma_uart->rx_read += len;
+    dma_uart->rx_pos += len;
+    if (dma_uart->rx_pos >= dma_uart->dma_len) {
+        dma_uart->rx_pos -= dma_uart->dma_len;
+    }
+    if (dma_uart->rts_stopped) {
+        int write_pos;
+        update_rts(dma_uart, rx_written(dma_uart, &write_pos) - dma_uart->rx_read, RTS_STOP_LEVEL((uint32_t)dma_uart->dma_len));
+    }
+}
+// True if there is received data that has not been read
+bool dma_rx_pending(int uart_num) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    int         write_pos;
+    if (!dma_uart->dma_len) {
+        return false;
+    }
+    return dma_uart->rx_cached || rx_written(dma_uart, &write_pos) != dma_uart->rx_read;
 }
+// Single-byte reads look at the DMA counter only when the data that
+// was found by the previous look has been used up
 int dma_getchar(int uart_num) {
     dma_uart_t* dma_uart = &dma_uarts[uart_num];
-    // The DMA-mode HAL UART driver receives data to a ring buffer.
-    // We chase the buffer pointer and pull out the data.
-    int last  = dma_uart->last_dma_count;
-    int this  = __HAL_DMA_GET_COUNTER(dma_uart->huart.hdmarx);
-    int count = last - this;
-    if (count < 0) {
-        count += dma_uart->dma_len;
-    }
-    if (count) {
-        uint8_t c = dma_uart->dma_buf[dma_uart->dma_len - dma_uart->last_dma_count];
-        --dma_uart->last_dma_count;
-        if (dma_uart->last_dma_count < 0) {
-            dma_uart->last_dma_count += dma_uart->dma_len;
+    if (!dma_uart->rx_cached) {
+        dma_span_t spans[2];
+        if (!dma_read_spans(uart_num, spans)) {
+            return -1;
         }
-        return c;
     }
-    return -1;
+    uint8_t c = dma_uart->dma_buf[dma_uart->rx_pos];
+    --dma_uart->rx_cached;
+    ++dma_uart->rx_read;
+    if (++dma_uart->rx_pos == dma_uart->dma_len) {
+        dma_uart->rx_pos = 0;
+    }
+    return c;
 }
 
 void DMA1_Channel5_IRQHandler(void) {
@@ -133,3 +522,91 @@ void DMA1_Channel5_IRQHandler(void) {
 void DMA1_Channel6_IRQHandler(void) {
     HAL_DMA_IRQHandler(&(dma_uarts[1].hdma));
 }
+
+// Clear the idle line and error flags by reading SR then DR.  An idle
+// line is only detected after the DMA has taken the last byte of a
+// burst, so the data register read does not steal received data.
+static void uart_irq(dma_uart_t* dma_uart) {
+    USART_TypeDef* uart = dma_uart->huart.Instance;
+    uint32_t       sr   = uart->SR;
+    if (sr & (USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_PE)) {
+        (void)uart->DR;
+    }
+    if (sr & USART_SR_ORE) {
+        ++dma_uart->stats.overrun_errors;
+    }
+    if (sr & USART_SR_FE) {
+        ++dma_uart->stats.framing_errors;
+    }
+    if (sr & USART_SR_NE) {
+        ++dma_uart->stats.noise_errors;
+    }
+    if (sr & USART_SR_IDLE) {
+        rx_irq_rts(dma_uart);
+    }
+}
+
+static uint32_t uart_clock(dma_uart_t* dma_uart) {
+    return dma_uart->huart.Instance == USART1 ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+}
+
+// With 16x oversampling the USART divides its clock by BRR, in units of
+// 1/16 of a bit time, so the fastest rate is clock / 16.  A rate is
+// usable if the nearest divisor is within 2% of it.
+bool dma_uart_baud_ok(int uart_num, uint32_t baud) {
+    uint32_t clock = uart_clock(&dma_uarts[uart_num]);
+    if (baud < 1200 || baud > clock / 16) {
+        return false;
+    }
+    uint32_t brr    = (clock + baud / 2) / baud;
+    uint32_t actual = clock / brr;
+    uint32_t error  = actual > baud ? actual - baud : baud - actual;
+    return error <= baud / 50;
+}
+// Change the rate after the pending output has been sent
+void dma_uart_set_baud(int uart_num, uint32_t baud) {
+    dma_uart_t*    dma_uart = &dma_uarts[uart_num];
+    USART_TypeDef* uart     = dma_uart->huart.Instance;
+
+    if (!dma_uart->dma_len) {
+        return;
+    }
+    dma_flush(uart_num);
+    uint32_t clock = uart_clock(dma_uart);
+    CLEAR_BIT(uart->CR1, USART_CR1_UE);
+    uart->BRR                     = (clock + baud / 2) / baud;
+    dma_uart->huart.Init.BaudRate = baud;
+    SET_BIT(uart->CR1, USART_CR1_UE);
+}
+
+// Copy the counters, which interrupt handlers update
+void dma_uart_stats(int uart_num, dma_uart_stats_t* stats) {
+    dma_uart_t* dma_uart = &dma_uarts[uart_num];
+    int         write_pos;
+
+    if (!dma_uart->dma_len) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *stats          = dma_uart->stats;
+    stats->rx_bytes = rx_written(dma_uart, &write_pos);
+    __set_PRIMASK(primask);
+}
+
+void USART1_IRQHandler(void) {
+    uart_irq(&dma_uarts[0]);
+}
+
+void USART2_IRQHandler(void) {
+    uart_irq(&dma_uarts[1]);
+}
+
+void DMA1_Channel4_IRQHandler(void) {
+    HAL_DMA_IRQHandler(&(dma_uarts[0].hdma_tx));
+}
+
+void DMA1_Channel7_IRQHandler(void) {
+    HAL_DMA_IRQHandler(&(dma_uarts[1].hdma_tx));
+}
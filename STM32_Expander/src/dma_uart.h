@@ -1,7 +1,54 @@
 #include "stm32f1xx_hal.h"
 #include <stdint.h>
+#include <stdbool.h>
 
-void init_dma_uart(int uart_num, int baud, GPIO_TypeDef* tx_port, uint16_t tx_pin, GPIO_TypeDef* rx_port, uint16_t rx_pin);
-void dma_print(int uart_num, const char* msg);
-void dma_putchar(int uart_num, uint8_t c);
-int  dma_getchar(int uart_num);
+// A contiguous region of received data in a DMA ring buffer
+typedef struct {
+    const uint8_t* data;
+    int            len;
+} dma_span_t;
+
+// Traffic and error counters, accumulated since init_dma_uart()
+typedef struct {
+    uint32_t rx_bytes;        // Bytes received
+    uint32_t tx_bytes;        // Bytes transmitted
+    uint32_t rx_peak;         // Most unread bytes seen in the receive ring
+    uint32_t rx_overruns;     // Times the receive DMA lapped the reader
+    uint32_t overrun_errors;  // USART overrun errors
+    uint32_t framing_errors;
+    uint32_t noise_errors;
+} dma_uart_stats_t;
+
+// Optional flow control for each UART.  A board enables it by defining
+// uart_flow[] in its gpiomap.c; the default has none.
+// RTS is driven in software from the receive ring's fill level, so it
+// can be any output pin, and is low when the peer may send.  CTS uses
+// the USART hardware, so it must be the USART's CTS pin, PA11 for
+// USART1 or PA0 for USART2, and it stops transmission while it is high.
+// The pins must not also appear in gpio_map[].
+typedef struct {
+    GPIO_TypeDef* rts_port;  // NULL for no RTS
+    uint16_t      rts_pin;
+    bool          cts;
+} uart_flow_t;
+
+extern const uart_flow_t uart_flow[2];
+
+void     init_dma_uart(int uart_num, int baud, GPIO_TypeDef* tx_port, uint16_t tx_pin, GPIO_TypeDef* rx_port, uint16_t rx_pin);
+void     dma_print(int uart_num, const char* msg);
+void     dma_putchar(int uart_num, uint8_t c);
+int      dma_write(int uart_num, const uint8_t* data, int len);
+int      dma_tx_space(int uart_num);
+void     dma_flush(int uart_num);
+bool     dma_send_span(int uart_num, const uint8_t* data, int len);
+bool     dma_tx_busy(int uart_num);
+uint16_t dma_tx_position(int uart_num);
+bool     dma_tx_reached(int uart_num, uint16_t position);
+int      dma_getchar(int uart_num);
+int      dma_read_spans(int uart_num, dma_span_t spans[2]);
+void     dma_consume(int uart_num, int len);
+bool     dma_rx_pending(int uart_num);
+uint32_t dma_rx_overruns(int uart_num);
+void     dma_uart_stats(int uart_num, dma_uart_stats_t* stats);
+bool     dma_uart_baud_ok(int uart_num, uint32_t baud);
+void     dma_uart_set_baud(int uart_num, uint32_t baud);
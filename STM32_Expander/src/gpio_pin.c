@@ -10,28 +10,211 @@
 #include "gpio_pin.h"
 #include "pwm_pin.h"
 #include "gpiomap.h"
+#include "pool.h"
+#include <string.h>
 
-int set_gpio(gpio_pin_t* gpio, bool high) {
+// EXTI input capture.  Each EXTI line N can watch pin N of one GPIO port.
+// The interrupt handler timestamps every edge into a single-producer,
+// single-consumer ring that pin.c drains via get_gpio_event().
+static const gpio_pin_t* exti_gpios[16];
+
+// The queue is allocated from the buffer pool when the first pin is
+// set up for edge capture; its length is GPIO_EVENT_QUEUE_LEN in pool.h.
+static gpio_event_t*     event_queue = NULL;
+static volatile uint16_t event_head  = 0;  // Written only by the interrupt handler
+static volatile uint16_t event_tail  = 0;  // Written only by the main loop
+volatile uint32_t        gpio_event_overflows = 0;
+
+static int exti_line(const gpio_pin_t* gpio) {
+    return __builtin_ctz(gpio->pin_num);
+}
+
+static IRQn_Type exti_irqn(int line) {
+    if (line <= 4) {
+        return EXTI0_IRQn + line;
+    }
+    return line <= 9 ? EXTI9_5_IRQn : EXTI15_10_IRQn;
+}
+
+// Stop capturing edges on the pin, if it was doing so
+static void exti_detach(const gpio_pin_t* gpio) {
+    int line = exti_line(gpio);
+    if (exti_gpios[line] == gpio) {
+        uint32_t mask = 1 << line;
+        EXTI->IMR &= ~mask;
+        EXTI->RTSR &= ~mask;
+        EXTI->FTSR &= ~mask;
+        exti_gpios[line] = NULL;
+    }
+}
+
+static void exti_irq(uint32_t lines) {
+    uint32_t pending = EXTI->PR & lines;
+    EXTI->PR         = pending;  // Writing 1 clears the pending bit
+    uint32_t now     = microseconds();
+    while (pending) {
+        int line = __builtin_ctz(pending);
+        pending &= pending - 1;
+
+        const gpio_pin_t* gpio = exti_gpios[line];
+        if (!gpio) {
+            continue;
+        }
+        uint16_t head = event_head;
+        uint16_t next = (head + 1) & (GPIO_EVENT_QUEUE_LEN - 1);
+        if (next == event_tail) {
+            ++gpio_event_overflows;
+            continue;
+        }
+        gpio_event_t* event = &event_queue[head];
+        event->micros       = now;
+        event->pin_num      = gpio - gpio_map;
+        event->high         = (gpio->port->IDR & gpio->pin_num) != 0;
+        __DMB();  // The entry must be complete before it is published
+        event_head = next;
+    }
+}
+
+void EXTI0_IRQHandler(void) {
+    exti_irq(1 << 0);
+}
+void EXTI1_IRQHandler(void) {
+    exti_irq(1 << 1);
+}
+void EXTI2_IRQHandler(void) {
+    exti_irq(1 << 2);
+}
+void EXTI3_IRQHandler(void) {
+    exti_irq(1 << 3);
+}
+void EXTI4_IRQHandler(void) {
+    exti_irq(1 << 4);
+}
+void EXTI9_5_IRQHandler(void) {
+    exti_irq(0x03e0);
+}
+void EXTI15_10_IRQHandler(void) {
+    exti_irq(0xfc00);
+}
+
+bool gpio_events_pending() {
+    return event_tail != event_head;
+}
+bool get_gpio_event(gpio_event_t* event) {
+    uint16_t tail = event_tail;
+    if (tail == event_head) {
+        return false;
+    }
+    *event = event_queue[tail];
+    __DMB();  // Finish reading the entry before releasing it to the producer
+    event_tail = (tail + 1) & (GPIO_EVENT_QUEUE_LEN - 1);
+    return true;
+}
+
+int set_gpio(const gpio_pin_t* gpio, bool high) {
     GPIO_PinState pinstate = high ? GPIO_PIN_SET : GPIO_PIN_RESET;
     HAL_GPIO_WritePin(gpio->port, gpio->pin_num, pinstate);
     return true;
 }
-bool get_gpio(gpio_pin_t* gpio) {
+// Set several outputs at once.  The pins are gathered into one BSRR
+// value per port so all the pins on a given port change in the same
+// clock cycle, and pins on different ports change a few cycles apart.
+void set_gpio_group(const gpio_pin_t* group[], const bool high[], int count) {
+    GPIO_TypeDef* ports[8];
+    uint32_t      bsrr[8];
+    int           n_ports = 0;
+
+    for (int i = 0; i < count; i++) {
+        const gpio_pin_t* gpio = group[i];
+        int               j;
+        for (j = 0; j < n_ports && ports[j] != gpio->port; j++) {}
+        if (j == n_ports) {
+            ports[j] = gpio->port;
+            bsrr[j]  = 0;
+            ++n_ports;
+        }
+        // The low half of BSRR sets pins and the high half resets them
+        bsrr[j] |= high[i] ? gpio->pin_num : (uint32_t)gpio->pin_num << 16;
+    }
+    for (int j = 0; j < n_ports; j++) {
+        ports[j]->BSRR = bsrr[j];
+    }
+}
+// Port-wide input sampling.  Each port's IDR is read once per scan and
+// compared with a snapshot, and only the bits that differ are mapped
+// back to pin numbers to update the cached pin levels.
+#define N_PORTS 5
+static GPIO_TypeDef* const scan_ports[N_PORTS] = { GPIOA, GPIOB, GPIOC, GPIOD, GPIOE };
+
+static pin_set_t scan_pins   = 0;  // The pin set that the tables below were built for
+static pin_set_t scan_levels = 0;
+static uint16_t  port_masks[N_PORTS];     // Input bits on each port
+static uint16_t  port_snapshots[N_PORTS];  // IDR & port_masks as of the last scan
+static uint8_t   port_pins[N_PORTS][16];   // Pin number for each port bit
+
+static int port_index(GPIO_TypeDef* port) {
+    for (int i = 0; i < N_PORTS; i++) {
+        if (scan_ports[i] == port) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+pin_set_t get_gpio_levels(pin_set_t pins) {
+    if (pins != scan_pins) {
+        // The set of inputs changed, so rebuild the port tables.  Zero
+        // snapshots make the next scan pick up every pin that is high.
+        scan_pins   = pins;
+        scan_levels = 0;
+        memset(port_masks, 0, sizeof(port_masks));
+        memset(port_snapshots, 0, sizeof(port_snapshots));
+        for (pin_set_t rest = pins; rest; rest &= rest - 1) {
+            uint8_t           pin_num = __builtin_ctzll(rest);
+            const gpio_pin_t* gpio    = &gpio_map[pin_num];
+            int               port    = port_index(gpio->port);
+            if (port >= 0) {
+                port_masks[port] |= gpio->pin_num;
+                port_pins[port][__builtin_ctz(gpio->pin_num)] = pin_num;
+            }
+        }
+    }
+    for (int port = 0; port < N_PORTS; port++) {
+        uint16_t mask = port_masks[port];
+        if (!mask) {
+            continue;
+        }
+        uint16_t levels  = scan_ports[port]->IDR & mask;
+        uint16_t changed = levels ^ port_snapshots[port];
+        if (changed) {
+            port_snapshots[port] = levels;
+            do {
+                scan_levels ^= (pin_set_t)1 << port_pins[port][__builtin_ctz(changed)];
+                changed &= changed - 1;
+            } while (changed);
+        }
+    }
+    return scan_levels;
+}
+bool get_gpio(const gpio_pin_t* gpio) {
     GPIO_PinState pinval = HAL_GPIO_ReadPin(gpio->port, gpio->pin_num);
     return pinval == GPIO_PIN_SET;
 }
-int set_pwm(gpio_pin_t* gpio, int32_t numerator, uint32_t denominator) {
-    PWM_Duty(gpio, numerator);
+int set_pwm(const gpio_pin_t* gpio, int32_t numerator, uint32_t denominator) {
+    PWM_Duty(gpio, numerator, denominator);
     return true;
 }
-void deinit_gpio(gpio_pin_t* gpio) {
+void deinit_gpio(const gpio_pin_t* gpio) {
+    exti_detach(gpio);
     HAL_GPIO_DeInit(gpio->port, gpio->pin_num);
 }
-bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode) {
+bool set_gpio_mode(const gpio_pin_t* gpio, pin_mode_t pinmode) {
     GPIO_InitTypeDef gpiomode;
     gpiomode.Pin   = gpio->pin_num;
     gpiomode.Speed = GPIO_SPEED_FREQ_HIGH;
 
+    exti_detach(gpio);
+
     if (pinmode & PIN_OUTPUT) {
         if (!(gpio->capabilities & OUT)) {
             return false;
@@ -58,7 +241,19 @@ bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode) {
         if (!(gpio->capabilities & IN)) {
             return false;
         }
-        gpiomode.Mode = GPIO_MODE_INPUT;
+        int line = exti_line(gpio);
+        if (pinmode & PIN_IRQ) {
+            // The EXTI line might already belong to the same pin number on another port
+            if (exti_gpios[line]) {
+                return false;
+            }
+            if (!event_queue && !(event_queue = pool_alloc(GPIO_EVENT_QUEUE_LEN * sizeof(gpio_event_t)))) {
+                return false;
+            }
+            gpiomode.Mode = GPIO_MODE_IT_RISING_FALLING;
+        } else {
+            gpiomode.Mode = GPIO_MODE_INPUT;
+        }
         if (pinmode & PIN_PULLUP) {
             if (!(gpio->capabilities & PU)) {
                 return false;
@@ -74,7 +269,12 @@ bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode) {
         }
         HAL_GPIO_Init(gpio->port, &gpiomode);
 
-        // attachInterrupt(digitalPinToInterrupt(stm_pin_num), pin_interrupt, CHANGE);
+        if (pinmode & PIN_IRQ) {
+            exti_gpios[line] = gpio;
+            IRQn_Type irqn   = exti_irqn(line);
+            HAL_NVIC_SetPriority(irqn, 0, 0);
+            HAL_NVIC_EnableIRQ(irqn);
+        }
         return true;
     }
     return false;
@@ -91,7 +291,7 @@ void gpio_clock_enable(GPIO_TypeDef* port) {
     }
 }
 
-void init_gpio(gpio_pin_t* gpio) {
+void init_gpio(const gpio_pin_t* gpio) {
     gpio_clock_enable(gpio->port);
     if (gpio->capabilities & OUT) {
         set_gpio_mode(gpio, PIN_OUTPUT);
@@ -101,7 +301,7 @@ void init_gpio(gpio_pin_t* gpio) {
 }
 void init_from_gpiomap() {
     for (int i = 0; i < n_pins; i++) {
-        gpio_pin_t* gpio = &(gpios[i].gpio);
+        const gpio_pin_t* gpio = &gpio_map[i];
         if (gpio->capabilities & (IN | OUT)) {
             init_gpio(gpio);
         }
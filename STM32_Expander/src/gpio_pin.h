@@ -6,6 +6,22 @@
 #include "pinmode.h"
 #include "stm32f1xx_hal.h"
 
+// AFIO remap settings under which a pin is connected to its timer
+// channel, one bit for each value of the timer's remap field in
+// AFIO_MAPR.  A gpio_pin_t with remaps 0 uses the default mapping only.
+#define TIM_MAP0 (1 << 0)  // No remap
+#define TIM_MAP1 (1 << 1)  // TIM1 partial, TIM2 partial 1, TIM4 remap
+#define TIM_MAP2 (1 << 2)  // TIM2 partial 2, TIM3 partial
+#define TIM_MAP3 (1 << 3)  // Full remap
+
+// A timer channel output that can drive a pin
+typedef struct {
+    uint8_t timer_num;  // 0 if none
+    uint8_t channel;
+    uint8_t remaps;     // TIM_MAPn settings that connect the channel to the pin
+    bool    n_output;   // The channel's inverted output CHxN, used as a plain PWM output
+} pwm_route_t;
+
 // The internals of this struct are MCU-specific
 typedef struct {
     // Implementation for STM32 HAL
@@ -14,15 +30,20 @@ typedef struct {
     uint8_t       capabilities;
     uint8_t       timer_num;
     uint8_t       timer_channel;
+    uint8_t       remaps;         // TIM_MAPn settings that connect the pin to the timer
+    bool          complementary;  // The pin is the inverted output CHxN of timer_channel
+    pwm_route_t   alt;            // Another timer channel that can drive the pin as PWM
 } gpio_pin_t;
 
 // This API is MCU-independent
-int  set_gpio(gpio_pin_t* gpio, bool high);
-bool get_gpio(gpio_pin_t* gpio);
-int  set_pwm(gpio_pin_t* gpio, int32_t numerator, uint32_t denominator);
-void deinit_gpio(gpio_pin_t* gpio);
-void deinit_pwm(gpio_pin_t* gpio);
-bool set_gpio_mode(gpio_pin_t* gpio, pin_mode_t pinmode);
-void init_gpio(gpio_pin_t* gpio);
+int  set_gpio(const gpio_pin_t* gpio, bool high);
+void set_gpio_group(const gpio_pin_t* group[], const bool high[], int count);
+bool get_gpio(const gpio_pin_t* gpio);
+int  set_pwm(const gpio_pin_t* gpio, int32_t numerator, uint32_t denominator);
+void deinit_gpio(const gpio_pin_t* gpio);
+void deinit_pwm(const gpio_pin_t* gpio);
+bool set_gpio_mode(const gpio_pin_t* gpio, pin_mode_t pinmode);
+void init_gpio(const gpio_pin_t* gpio);
 void gpio_clock_enable(GPIO_TypeDef* port);
 void init_from_gpiomap();
+bool gpio_events_pending();
@@ -5,7 +5,10 @@
 
 #include "pin.h"
 
-extern pin_t gpios[];
+// gpio_map[] describes the board's pins and is constant, so it stays
+// in flash.  gpios[] holds the runtime state for the same pin numbers.
+extern const gpio_pin_t gpio_map[];
+extern pin_t            gpios[];
 
 extern const int n_pins;
 
@@ -0,0 +1,50 @@
+// Copyright (c) 2025 Mitch Bradley
+// Use of this source code is governed by a GPLv3 license that can be found in the LICENSE file.
+
+// Buffer pool for the UART rings, the pin event queue, and the PWM ramp rings.  Buffers are
+// allocated once at startup and never freed, so a bump allocator is all
+// that is needed.
+
+#include "pool.h"
+#include "pin.h"  // gpio_event_t
+#include <stdint.h>
+
+#define POOL_STR(x) #x
+#define POOL_XSTR(x) POOL_STR(x)
+
+#define EVENT_QUEUE_SIZE (GPIO_EVENT_QUEUE_LEN * sizeof(gpio_event_t))
+#define RAMP_SIZE (RAMP_TIMERS * RAMP_BUF_LEN * sizeof(uint16_t))
+#define POOL_SIZE (FNC_RX_LEN + FNC_TX_LEN + PASS_RX_LEN + PASS_TX_LEN + EVENT_QUEUE_SIZE + RAMP_SIZE)
+
+// Shown in the build output so the RAM split for each env is visible
+#pragma message("Buffer pool: FluidNC RX " POOL_XSTR(FNC_RX_LEN) " TX " POOL_XSTR(FNC_TX_LEN) \
+                ", pass-through RX " POOL_XSTR(PASS_RX_LEN) " TX " POOL_XSTR(PASS_TX_LEN) \
+                ", " POOL_XSTR(GPIO_EVENT_QUEUE_LEN) " pin events, " POOL_XSTR(RAMP_BUF_LEN) " ramp steps")
+
+_Static_assert((FNC_RX_LEN & 1) == 0 && (PASS_RX_LEN & 1) == 0 && (RAMP_BUF_LEN & 1) == 0,
+               "Receive and ramp ring lengths must be even");
+_Static_assert((FNC_TX_LEN & (FNC_TX_LEN - 1)) == 0 && (PASS_TX_LEN & (PASS_TX_LEN - 1)) == 0,
+               "Transmit ring lengths must be powers of 2");
+// dma_uart.c keeps the transmit ring length and its free-running head
+// and tail in 16 bits, and the receive DMA count register is 16 bits
+_Static_assert(FNC_TX_LEN <= 32768 && PASS_TX_LEN <= 32768, "Transmit ring lengths must be at most 32768");
+_Static_assert(FNC_RX_LEN <= 65535 && PASS_RX_LEN <= 65535, "Receive ring lengths must be at most 65535");
+_Static_assert(GPIO_EVENT_QUEUE_LEN && (GPIO_EVENT_QUEUE_LEN & (GPIO_EVENT_QUEUE_LEN - 1)) == 0,
+               "GPIO_EVENT_QUEUE_LEN must be a power of 2");
+
+static uint8_t pool[POOL_SIZE] __attribute__((aligned(4)));
+static size_t  pool_used = 0;
+
+void* pool_alloc(size_t size) {
+    size = (size + 3) & ~(size_t)3;
+    if (size > sizeof(pool) - pool_used) {
+        return NULL;
+    }
+    void* p = &pool[pool_used];
+    pool_used += size;
+    return p;
+}
+
+size_t pool_available() {
+    return sizeof(pool) - pool_used;
+}
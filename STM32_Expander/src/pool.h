@@ -0,0 +1,67 @@
+// Copyright (c) 2025 Mitch Bradley
+// Use of this source code is governed by a GPLv3 license that can be found in the LICENSE file.
+
+// RAM for the UART rings, the pin event queue, and the PWM ramp rings comes from a single
+// pool whose size is the sum of the buffer lengths below.  Each length
+// can be set per board or env with a build flag, e.g. -DFNC_TX_LEN=2048.
+// The receive and ramp ring lengths must be even and the transmit ring
+// and event queue lengths must be powers of 2.  With 8-byte events and
+// 2-byte ramp steps the defaults add up to 10240 bytes.
+//
+// A build with -DNO_PASSTHROUGH does not use USART2, so the pass-through
+// rings take no space, and some of the RAM they would use goes to a
+// larger FluidNC transmit ring and event queue instead.  Its defaults
+// add up to 8448 bytes.
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef NO_PASSTHROUGH
+#    undef PASS_RX_LEN
+#    undef PASS_TX_LEN
+#    define PASS_RX_LEN 0
+#    define PASS_TX_LEN 0
+#endif
+
+#ifndef FNC_RX_LEN
+#    define FNC_RX_LEN 4096
+#endif
+
+#ifndef FNC_TX_LEN
+#    ifdef NO_PASSTHROUGH
+#        define FNC_TX_LEN 2048
+#    else
+#        define FNC_TX_LEN 1024
+#    endif
+#endif
+
+#ifndef PASS_RX_LEN
+#    define PASS_RX_LEN 4096
+#endif
+
+#ifndef PASS_TX_LEN
+#    define PASS_TX_LEN 512
+#endif
+
+#ifndef GPIO_EVENT_QUEUE_LEN
+#    ifdef NO_PASSTHROUGH
+#        define GPIO_EVENT_QUEUE_LEN 256
+#    else
+#        define GPIO_EVENT_QUEUE_LEN 32
+#    endif
+#endif
+
+// Duty values per PWM ramp ring.  Each ramp interrupts the CPU every
+// RAMP_BUF_LEN/2 PWM periods to compute the next values.
+#ifndef RAMP_BUF_LEN
+#    define RAMP_BUF_LEN 64
+#endif
+#define RAMP_TIMERS 2  // Only TIM2 and TIM3 have update DMA channels that the UARTs do not use
+
+// Returns 4-byte aligned memory that is never freed, or NULL if the
+// pool does not have size bytes left
+void* pool_alloc(size_t size);
+
+// Bytes of the pool not yet allocated
+size_t pool_available();
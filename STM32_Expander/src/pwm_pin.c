@@ -1,20 +1,61 @@
 #include "pin.h"
 #include "gpiomap.h"
+#include "pwm_pin.h"
+#include "pool.h"
+#include "Expander.h"  // RAMP_*, BREAK_*
 
 #define MAX_TIMER_NUM 4
 TIM_HandleTypeDef timer_handles[MAX_TIMER_NUM + 1];
-TIM_TypeDef*      timers[]                          = { 0, TIM1, TIM2, TIM3, TIM4 };
-uint32_t          timer_channels[]                  = { 0, TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3, TIM_CHANNEL_4 };
-uint16_t          timer_divisors[MAX_TIMER_NUM + 1] = { 0 };
+TIM_TypeDef*      timers[]                             = { 0, TIM1, TIM2, TIM3, TIM4 };
+uint32_t          timer_channels[]                     = { 0, TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3, TIM_CHANNEL_4 };
+uint32_t          timer_frequencies[MAX_TIMER_NUM + 1] = { 0 };  // Requested frequency, 0 if unused
 
-#define TIMER_CLOCK 60000000
-#define TIMER_RESOLUTION 999
+// The input clock of a timer.  TIM1 is on APB2 and the others are on
+// APB1.  When the APB prescaler is not 1, the timer clock is twice the
+// APB clock.
+static uint32_t timer_clock(int timer_num) {
+    if (timer_num == 1) {
+        uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+        return (RCC->CFGR & RCC_CFGR_PPRE2) == RCC_CFGR_PPRE2_DIV1 ? pclk : pclk * 2;
+    }
+    uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+    return (RCC->CFGR & RCC_CFGR_PPRE1) == RCC_CFGR_PPRE1_DIV1 ? pclk : pclk * 2;
+}
 
-bool Timer_Init(int timer_num, int frequency) {
+// Choose the prescaler and period for a frequency.  The duty resolution
+// is the period in timer ticks, so the prescaler is the smallest one
+// that lets the period fit in the 16-bit auto-reload register, and the
+// period is then rounded to the nearest tick.  The frequency error is
+// at most half a tick of the period.
+static bool solve_timer(uint32_t clock, uint32_t frequency, uint32_t* prescaler, uint32_t* period) {
+    if (frequency == 0 || frequency > clock / 2) {
+        return false;
+    }
+    uint32_t ticks = (clock + frequency / 2) / frequency;  // Prescaler times period
+    uint32_t psc   = (ticks + 0xffff) / 0x10000;
+    if (psc > 0x10000) {
+        return false;
+    }
+    uint64_t divisor = (uint64_t)psc * frequency;
+    uint32_t arr     = (clock + divisor / 2) / divisor;
+    if (arr > 0x10000) {
+        arr = 0x10000;
+    }
+    *prescaler = psc;
+    *period    = arr;
+    return true;
+}
+
+bool Timer_Init(int timer_num, uint32_t frequency) {
     if (timer_num < 1 || timer_num > 4) {
         return false;
     }
 
+    uint32_t prescaler, period;
+    if (!solve_timer(timer_clock(timer_num), frequency, &prescaler, &period)) {
+        return false;
+    }
+
     switch (timer_num) {
         case 1:
             __HAL_RCC_TIM1_CLK_ENABLE();
@@ -35,27 +76,12 @@ bool Timer_Init(int timer_num, int frequency) {
     TIM_ClockConfigTypeDef  sClockSourceConfig = { 0 };
     TIM_MasterConfigTypeDef sMasterConfig      = { 0 };
 
-    uint32_t max_frequency = TIMER_CLOCK / TIMER_RESOLUTION;
-    uint32_t divisor       = max_frequency / frequency;
-
-    if (divisor == 0) {
-        divisor = 1;
-    }
-    uint32_t existing_divisor = timer_divisors[timer_num];
-    if (existing_divisor != 0) {  // This TIM is already configured
-        // If the requested divisor is the same as the existing one,
-        // we can just use the existing setup for this timer.
-        // Otherwise we fail due to conflicting divisors for
-        // different channels
-        return existing_divisor == divisor;
-    }
-
     TIM_HandleTypeDef* handle = &timer_handles[timer_num];
 
     handle->Instance               = timers[timer_num];
-    handle->Init.Prescaler         = divisor - 1;
+    handle->Init.Prescaler         = prescaler - 1;
     handle->Init.CounterMode       = TIM_COUNTERMODE_UP;
-    handle->Init.Period            = TIMER_RESOLUTION;
+    handle->Init.Period            = period - 1;
     handle->Init.ClockDivision     = TIM_CLOCKDIVISION_DIV1;
     handle->Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
     if (HAL_TIM_Base_Init(handle) != HAL_OK) {
@@ -73,25 +99,163 @@ bool Timer_Init(int timer_num, int frequency) {
     if (HAL_TIMEx_MasterConfigSynchronization(handle, &sMasterConfig) != HAL_OK) {
         return false;
     }
-    timer_divisors[timer_num] = divisor;
+    timer_frequencies[timer_num] = frequency;
+    return true;
+}
+
+// Complementary outputs; see PWM_Complementary()
+static const gpio_pin_t* complement_gpios[4];  // CHxN pin of each TIM1 channel that uses it
+static uint32_t          complement_bdtr;      // Dead time and break settings in use
+
+// Timer channel allocation.  A pin can be driven by the timer channel in
+// its gpio_map[] entry or by its alternate route.  Pins that are already
+// running are never moved, since that would glitch their outputs, so a
+// pin gets the first of its routes that fits with all of them: the
+// channel must be free, some remap must reach the pin and every other
+// pin on the timer, and the timer must be unused or already have the
+// prescaler and period that the new frequency needs.  Each timer counts
+// the pins that use it, so its frequency is only released with the last.
+static pwm_route_t pin_routes[EXP_MAX_PINS];     // Route driving each pin, timer_num 0 if none
+static uint8_t     timer_users[MAX_TIMER_NUM + 1];
+static uint8_t     pin_conflicts[EXP_MAX_PINS];  // 1 + the pin that blocked the last PWM_Init(), 0 if none
+
+// AFIO remapping.  Each timer has one remap field in AFIO_MAPR that
+// moves all of its channels together, so a remap that connects one pin
+// to the timer can disconnect another.  The remap is chosen from the
+// settings that every pin driven by the timer allows, keeping the one
+// in effect if possible.
+static const uint32_t remap_pos[]  = { 0,
+                                       AFIO_MAPR_TIM1_REMAP_Pos,
+                                       AFIO_MAPR_TIM2_REMAP_Pos,
+                                       AFIO_MAPR_TIM3_REMAP_Pos,
+                                       AFIO_MAPR_TIM4_REMAP_Pos };
+static const uint32_t remap_mask[] = { 0,
+                                       AFIO_MAPR_TIM1_REMAP_Msk,
+                                       AFIO_MAPR_TIM2_REMAP_Msk,
+                                       AFIO_MAPR_TIM3_REMAP_Msk,
+                                       AFIO_MAPR_TIM4_REMAP_Msk };
+static uint8_t        timer_remaps[MAX_TIMER_NUM + 1];  // Remap field value in effect
+
+// Route n of a pin, 0 being its own timer channel and 1 the alternate.
+// Returns false if the pin has no such route.
+static bool pin_route(const gpio_pin_t* gpio, int n, pwm_route_t* route) {
+    if (n == 0) {
+        route->timer_num = gpio->timer_num;
+        route->channel   = gpio->timer_channel;
+        route->remaps    = gpio->remaps;
+        route->n_output  = gpio->complementary;
+    } else {
+        *route = gpio->alt;
+    }
+    if (!route->remaps) {
+        route->remaps = TIM_MAP0;
+    }
+    return route->timer_num >= 1 && route->timer_num <= MAX_TIMER_NUM && route->channel >= 1 && route->channel <= 4;
+}
+
+// The remaps that connect the route's timer to the route's pin and to
+// every other pin that the timer is driving
+static uint8_t route_remaps(const pwm_route_t* route, int pin_num) {
+    uint8_t allowed = route->remaps;
+    for (int i = 0; i < n_pins; i++) {
+        if (i != pin_num && pin_routes[i].timer_num == route->timer_num) {
+            allowed &= pin_routes[i].remaps;
+        }
+    }
+    return allowed;
+}
+
+// Set the remap of a timer, which callers also use to put back the one
+// that was in effect when a pin fails to start
+static void timer_set_remap(uint8_t timer_num, uint8_t remap) {
+    if (remap != timer_remaps[timer_num]) {
+        // SWJ_CFG is write-only, so it is rewritten with the setting from
+        // HAL_MspInit().  The HAL remap macros would turn off SWD instead.
+        uint32_t mapr           = AFIO->MAPR & ~(remap_mask[timer_num] | AFIO_MAPR_SWJ_CFG);
+        AFIO->MAPR              = mapr | ((uint32_t)remap << remap_pos[timer_num]) | AFIO_MAPR_SWJ_CFG_JTAGDISABLE;
+        timer_remaps[timer_num] = remap;
+    }
+}
+
+// Set the remap of a timer to one of the allowed settings
+static void timer_remap(uint8_t timer_num, uint8_t allowed) {
+    if (!(allowed & (1 << timer_remaps[timer_num]))) {
+        timer_set_remap(timer_num, __builtin_ctz(allowed));
+    }
+}
+
+// True if the pin can use the route at the frequency.  If another pin is
+// in the way, *blocker is set to it.
+static bool route_usable(const pwm_route_t* route, int pin_num, uint32_t frequency, int* blocker) {
+    uint8_t timer_num = route->timer_num;
+    uint8_t allowed   = route->remaps;
+    int     first     = -1;  // A pin that is using the timer
+    for (int i = 0; i < n_pins; i++) {
+        const pwm_route_t* r = &pin_routes[i];
+        if (i == pin_num || r->timer_num != timer_num) {
+            continue;
+        }
+        allowed &= r->remaps;
+        if (r->channel == route->channel || !allowed) {
+            *blocker = i;
+            return false;
+        }
+        if (first < 0) {
+            first = i;
+        }
+    }
+
+    uint32_t prescaler, period;
+    if (!solve_timer(timer_clock(timer_num), frequency, &prescaler, &period)) {
+        return false;
+    }
+    // Channels of one timer share its period, so the timer can only be
+    // shared if the new frequency divides the clock the same way
+    TIM_TypeDef* tim = timers[timer_num];
+    if (timer_users[timer_num] && (tim->PSC + 1 != prescaler || tim->ARR + 1 != period)) {
+        *blocker = first;
+        return false;
+    }
     return true;
 }
-bool PWM_Init(gpio_pin_t* gpio, uint32_t frequency, bool invert) {
-    uint8_t timer_num = gpio->timer_num;
-    if (!Timer_Init(timer_num, frequency)) {
+
+// Choose the route for a pin, or record the first pin that is in the way
+static bool choose_route(int pin_num, uint32_t frequency, pwm_route_t* chosen) {
+    int         blocker = -1;
+    pwm_route_t route;
+    for (int n = 0; n < 2; n++) {
+        int other = -1;
+        if (pin_route(&gpio_map[pin_num], n, &route) && route_usable(&route, pin_num, frequency, &other)) {
+            *chosen                = route;
+            pin_conflicts[pin_num] = 0;
+            return true;
+        }
+        if (blocker < 0) {
+            blocker = other;
+        }
+    }
+    pin_conflicts[pin_num] = blocker + 1;
+    return false;
+}
+
+// Start the route's timer channel driving the pin
+static bool pwm_start(const gpio_pin_t* gpio, const pwm_route_t* route, uint32_t frequency, bool invert) {
+    uint8_t timer_num = route->timer_num;
+    if (!timer_users[timer_num] && !Timer_Init(timer_num, frequency)) {
         return false;
     }
-    uint32_t           channel = timer_channels[gpio->timer_channel];
+    uint32_t           channel = timer_channels[route->channel];
     TIM_HandleTypeDef* handle  = &timer_handles[timer_num];
 
-    HAL_TIM_PWM_Stop(handle, channel);
-
     TIM_OC_InitTypeDef sConfigOC = { 0 };
 
-    sConfigOC.OCMode     = TIM_OCMODE_PWM1;
-    sConfigOC.Pulse      = 0;
-    sConfigOC.OCPolarity = invert ? TIM_OCPOLARITY_LOW : TIM_OCPOLARITY_HIGH;
-    sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+    // With only CHxN enabled, the N output follows the reference signal
+    // with its own polarity setting, just like the main output
+    sConfigOC.OCMode      = TIM_OCMODE_PWM1;
+    sConfigOC.Pulse       = 0;
+    sConfigOC.OCPolarity  = invert ? TIM_OCPOLARITY_LOW : TIM_OCPOLARITY_HIGH;
+    sConfigOC.OCNPolarity = invert ? TIM_OCNPOLARITY_LOW : TIM_OCNPOLARITY_HIGH;
+    sConfigOC.OCFastMode  = TIM_OCFAST_DISABLE;
     if (HAL_TIM_PWM_ConfigChannel(handle, &sConfigOC, channel) != HAL_OK) {
         return false;
     }
@@ -117,31 +281,651 @@ bool PWM_Init(gpio_pin_t* gpio, uint32_t frequency, bool invert) {
     GPIO_InitStruct.Speed            = GPIO_SPEED_FREQ_LOW;
     HAL_GPIO_Init(port, &GPIO_InitStruct);
 
-    return HAL_TIM_PWM_Start(handle, channel) == HAL_OK;
+    HAL_StatusTypeDef status = route->n_output ? HAL_TIMEx_PWMN_Start(handle, channel) : HAL_TIM_PWM_Start(handle, channel);
+    if (status != HAL_OK) {
+        HAL_GPIO_DeInit(port, gpio->pin_num);
+        return false;
+    }
+    return true;
 }
-void deinit_pwm(gpio_pin_t* gpio) {
-    uint8_t timer_num          = gpio->timer_num;
-    timer_divisors[timer_num]  = 0;
-    uint32_t           channel = timer_channels[gpio->timer_channel];
-    TIM_HandleTypeDef* handle  = &timer_handles[timer_num];
-    HAL_TIM_PWM_Stop(handle, channel);
+
+bool PWM_Init(const gpio_pin_t* gpio, uint32_t frequency, bool invert) {
+    int         pin_num = gpio - gpio_map;
+    pwm_route_t route;
+    if (!choose_route(pin_num, frequency, &route)) {
+        return false;
+    }
+    uint8_t timer_num = route.timer_num;
+    uint8_t old_remap = timer_remaps[timer_num];
+    timer_remap(timer_num, route_remaps(&route, pin_num));
+    if (!pwm_start(gpio, &route, frequency, invert)) {
+        // Reconnect whatever the old remap connected to the timer's pins
+        timer_set_remap(timer_num, old_remap);
+        return false;
+    }
+    pin_routes[pin_num] = route;
+    ++timer_users[timer_num];
+    return true;
 }
 
-void PWM_Duty(gpio_pin_t* gpio, uint32_t duty) {
-    uint8_t            timer_num = gpio->timer_num;
-    TIM_HandleTypeDef* handle    = &timer_handles[timer_num];
-    switch (gpio->timer_channel) {
-        case 1:
-            handle->Instance->CCR1 = duty;
+// Complementary outputs.  On the F103 only TIM1 has them, on channels
+// 1-3.  The inverted output CHxN of a channel that is already running
+// as PWM is turned on, and the timer's BDTR register inserts the dead
+// time, during which both outputs are inactive, at each edge.  The dead
+// time and break input apply to the whole timer, so every
+// complementary channel of the timer must use the same settings.  The
+// CHxN pins and the break input move with the TIM1 remap.
+
+// Encode a dead time in timer ticks for the DTG field of BDTR, which has
+// four ranges with increasing step sizes.  Returns -1 if it is too long.
+static int encode_dead_time(uint32_t ticks) {
+    if (ticks <= 127) {
+        return ticks;
+    }
+    if (ticks <= 2 * (64 + 63)) {
+        return 0x80 | ((ticks + 1) / 2 - 64);
+    }
+    if (ticks <= 8 * (32 + 31)) {
+        return 0xc0 | ((ticks + 7) / 8 - 32);
+    }
+    if (ticks <= 16 * (32 + 31)) {
+        return 0xe0 | ((ticks + 15) / 16 - 32);
+    }
+    return -1;
+}
+
+// True if a channel other than channel_num has its inverted output on
+static bool complement_in_use(uint8_t channel_num) {
+    for (int i = 1; i < 4; i++) {
+        if (i != channel_num && complement_gpios[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The break input, PB12 or PA6 with the TIM1 partial remap, while it is
+// in use.  All complementary channels share it.
+static GPIO_TypeDef*     bkin_port;  // NULL if the break input is off
+static uint16_t          bkin_pin;
+static const gpio_pin_t* bkin_gpio;  // Its gpio_map[] entry, if the board has one
+
+// Pull the break input to its inactive level and claim its pin, unless
+// the board is using the pin for something else
+static bool bkin_claim(uint8_t brk) {
+    GPIO_TypeDef* port    = timer_remaps[1] == 1 ? GPIOA : GPIOB;
+    uint16_t      pin_num = timer_remaps[1] == 1 ? GPIO_PIN_6 : GPIO_PIN_12;
+    if (bkin_port == port && bkin_pin == pin_num) {
+        return true;  // Already set up for another channel
+    }
+    const gpio_pin_t* g = NULL;
+    for (int i = 0; i < n_pins; i++) {
+        if (gpio_map[i].port == port && gpio_map[i].pin_num == pin_num) {
+            g = &gpio_map[i];
             break;
+        }
+    }
+    if (g && gpios[g - gpio_map].initialized) {
+        return false;
+    }
+
+    GPIO_InitTypeDef GPIO_InitStruct = { 0 };
+    GPIO_InitStruct.Pin              = pin_num;
+    GPIO_InitStruct.Mode             = GPIO_MODE_INPUT;
+    GPIO_InitStruct.Pull             = brk == BREAK_HIGH ? GPIO_PULLDOWN : GPIO_PULLUP;
+    gpio_clock_enable(port);
+    HAL_GPIO_Init(port, &GPIO_InitStruct);
+
+    if (g) {
+        pin_t* pin       = &gpios[g - gpio_map];
+        pin->initialized = true;
+        pin->type        = pin_type_none;
+    }
+    bkin_port = port;
+    bkin_pin  = pin_num;
+    bkin_gpio = g;
+    return true;
+}
+
+// Turn off the break function and give its pin back
+static void bkin_release() {
+    if (!bkin_port) {
+        return;
+    }
+    timer_handles[1].Instance->BDTR &= ~TIM_BDTR_BKE;
+    HAL_GPIO_DeInit(bkin_port, bkin_pin);
+    if (bkin_gpio) {
+        gpios[bkin_gpio - gpio_map].initialized = false;
+    }
+    bkin_port = NULL;
+    bkin_gpio = NULL;
+}
+
+// Undo a PWM_Complementary() that failed.  HAL_TIMEx_ConfigBreakDeadTime()
+// rewrites BDTR, clearing MOE, which would turn off every TIM1 output,
+// so BDTR and the TIM1 remap go back to what they were.
+static bool complement_fail(uint8_t channel_num, uint8_t remap, uint32_t bdtr) {
+    if (!complement_in_use(channel_num)) {
+        bkin_release();
+    }
+    timer_handles[1].Instance->BDTR = bdtr;
+    timer_set_remap(1, remap);
+    return false;
+}
+
+bool PWM_Complementary(const gpio_pin_t* gpio, uint32_t deadtime_ns, uint8_t brk) {
+    const pwm_route_t* route       = &pin_routes[gpio - gpio_map];
+    uint8_t            channel_num = route->channel;
+    if (route->timer_num != 1 || route->n_output || channel_num < 1 || channel_num > 3) {
+        return false;
+    }
+
+    // The board must route the CHxN output to a pin that is free
+    const gpio_pin_t* n_gpio = NULL;
+    pwm_route_t       n_route;
+    for (int i = 0; i < n_pins && !n_gpio; i++) {
+        for (int n = 0; n < 2; n++) {
+            if (pin_route(&gpio_map[i], n, &n_route) && n_route.n_output && n_route.timer_num == 1 && n_route.channel == channel_num) {
+                n_gpio = &gpio_map[i];
+                break;
+            }
+        }
+    }
+    if (!n_gpio || (gpios[n_gpio - gpio_map].initialized && complement_gpios[channel_num] != n_gpio)) {
+        return false;
+    }
+    uint8_t allowed = route_remaps(&n_route, n_gpio - gpio_map);
+    if (!allowed) {
+        return false;
+    }
+
+    // Round the dead time up so it is never shorter than requested
+    uint32_t ticks = ((uint64_t)deadtime_ns * timer_clock(1) + 999999999) / 1000000000;
+    int      dtg   = encode_dead_time(ticks);
+    if (dtg < 0) {
+        return false;
+    }
+    uint32_t bdtr = dtg | ((uint32_t)brk << 8);
+    if (complement_in_use(channel_num) && bdtr != complement_bdtr) {
+        return false;
+    }
+
+    TIM_HandleTypeDef* handle    = &timer_handles[1];
+    uint32_t           channel   = timer_channels[channel_num];
+    uint8_t            old_remap = timer_remaps[1];
+    uint32_t           old_bdtr  = handle->Instance->BDTR;
+
+    timer_remap(1, allowed);
+    if (brk != BREAK_NONE && !bkin_claim(brk)) {
+        return complement_fail(channel_num, old_remap, old_bdtr);
+    }
+
+    TIM_BreakDeadTimeConfigTypeDef sBreakDeadTimeConfig = { 0 };
+
+    sBreakDeadTimeConfig.OffStateRunMode  = TIM_OSSR_DISABLE;
+    sBreakDeadTimeConfig.OffStateIDLEMode = TIM_OSSI_DISABLE;
+    sBreakDeadTimeConfig.LockLevel        = TIM_LOCKLEVEL_OFF;
+    sBreakDeadTimeConfig.DeadTime         = dtg;
+    sBreakDeadTimeConfig.BreakState       = brk == BREAK_NONE ? TIM_BREAK_DISABLE : TIM_BREAK_ENABLE;
+    sBreakDeadTimeConfig.BreakPolarity    = brk == BREAK_HIGH ? TIM_BREAKPOLARITY_HIGH : TIM_BREAKPOLARITY_LOW;
+    sBreakDeadTimeConfig.AutomaticOutput  = TIM_AUTOMATICOUTPUT_DISABLE;
+    if (HAL_TIMEx_ConfigBreakDeadTime(handle, &sBreakDeadTimeConfig) != HAL_OK) {
+        return complement_fail(channel_num, old_remap, old_bdtr);
+    }
+
+    // The inverted output has the same polarity setting as the main one
+    uint32_t np = TIM_CCER_CC1NP << (4 * (channel_num - 1));
+    if (handle->Instance->CCER & (TIM_CCER_CC1P << (4 * (channel_num - 1)))) {
+        handle->Instance->CCER |= np;
+    } else {
+        handle->Instance->CCER &= ~np;
+    }
+
+    gpio_clock_enable(n_gpio->port);
+    GPIO_InitTypeDef GPIO_InitStruct = { 0 };
+    GPIO_InitStruct.Pin              = n_gpio->pin_num;
+    GPIO_InitStruct.Mode             = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Speed            = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(n_gpio->port, &GPIO_InitStruct);
+
+    if (HAL_TIMEx_PWMN_Start(handle, channel) != HAL_OK) {
+        HAL_GPIO_DeInit(n_gpio->port, n_gpio->pin_num);
+        return complement_fail(channel_num, old_remap, old_bdtr);
+    }
+
+    // Claim the CHxN pin so it cannot be configured for something else
+    pin_t* n_pin       = &gpios[n_gpio - gpio_map];
+    n_pin->initialized = true;
+    n_pin->type        = pin_type_none;
+
+    pin_routes[n_gpio - gpio_map] = n_route;
+    complement_gpios[channel_num] = n_gpio;
+    complement_bdtr               = bdtr;
+    return true;
+}
+
+// Turn off the inverted output of the pin's channel, if it is on
+static void complement_stop(const gpio_pin_t* gpio) {
+    const pwm_route_t* route = &pin_routes[gpio - gpio_map];
+    if (route->timer_num != 1 || route->n_output || !complement_gpios[route->channel]) {
+        return;
+    }
+    const gpio_pin_t* n_gpio = complement_gpios[route->channel];
+    HAL_TIMEx_PWMN_Stop(&timer_handles[1], timer_channels[route->channel]);
+    HAL_GPIO_DeInit(n_gpio->port, n_gpio->pin_num);
+    gpios[n_gpio - gpio_map].initialized     = false;
+    pin_routes[n_gpio - gpio_map].timer_num = 0;
+    complement_gpios[route->channel]        = NULL;
+    if (!complement_in_use(0)) {
+        bkin_release();  // That was the last complementary channel
+    }
+}
+
+// The frequency that the pin's timer actually runs at and its number of duty steps
+bool PWM_Info(const gpio_pin_t* gpio, uint32_t* frequency, uint32_t* steps) {
+    uint8_t timer_num = pin_routes[gpio - gpio_map].timer_num;
+    if (!timer_num) {
+        return false;
+    }
+    TIM_TypeDef* tim = timer_handles[timer_num].Instance;
+    *steps           = tim->ARR + 1;
+    *frequency       = timer_clock(timer_num) / ((uint64_t)(tim->PSC + 1) * *steps);
+    return true;
+}
+
+// The pin that kept the last PWM_Init() of a pin from getting a timer
+// channel, and the frequency that it is running at
+bool PWM_Conflict(const gpio_pin_t* gpio, uint8_t* other_pin, uint32_t* frequency) {
+    int other = pin_conflicts[gpio - gpio_map] - 1;
+    if (other < 0) {
+        return false;
+    }
+    *other_pin = other;
+    *frequency = timer_frequencies[pin_routes[other].timer_num];
+    return true;
+}
+
+static volatile uint32_t* ccr_register(const gpio_pin_t* gpio) {
+    const pwm_route_t* route = &pin_routes[gpio - gpio_map];
+    TIM_TypeDef*       tim   = timer_handles[route->timer_num].Instance;
+    switch (route->channel) {
+        case 1:
+            return &tim->CCR1;
         case 2:
-            handle->Instance->CCR2 = duty;
-            break;
+            return &tim->CCR2;
         case 3:
-            handle->Instance->CCR3 = duty;
-            break;
-        case 4:
-            handle->Instance->CCR4 = duty;
-            break;
+            return &tim->CCR3;
+        default:
+            return &tim->CCR4;
+    }
+}
+
+// Servo outputs.  The pulse width is kept in timer ticks, which
+// solve_timer() makes 1/3 us or finer at servo frame rates, so a
+// position in microseconds is reproduced within a fraction of a
+// microsecond.  When a slew limit is set, the timer's update interrupt
+// moves the pulse width toward the target by a fixed step each period,
+// in 1/256 tick units so slow rates are still smooth, and turns itself
+// off when every servo on the timer has arrived.
+#ifndef MAX_SERVOS
+#    define MAX_SERVOS 8
+#endif
+
+typedef struct {
+    const gpio_pin_t*  gpio;  // NULL if the slot is free
+    volatile uint32_t* ccr;
+    uint8_t            timer_num;
+    uint32_t           min;       // Lower travel limit in ticks
+    uint32_t           max;       // Upper travel limit in ticks
+    uint32_t           step;      // Most the pulse width can change each period, in 1/256 ticks, 0 for no limit
+    int32_t            position;  // Present pulse width in 1/256 ticks, 0 before the first move
+    int32_t            target;    // Pulse width to move to in 1/256 ticks
+} servo_t;
+
+static servo_t         servos[MAX_SERVOS];
+static const IRQn_Type update_irqs[] = { 0, TIM1_UP_IRQn, TIM2_IRQn, TIM3_IRQn, TIM4_IRQn };
+
+static servo_t* find_servo(const gpio_pin_t* gpio) {
+    for (int i = 0; i < MAX_SERVOS; i++) {
+        if (servos[i].gpio == gpio) {
+            return &servos[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t us_to_ticks(uint8_t timer_num, uint32_t us) {
+    TIM_TypeDef* tim = timer_handles[timer_num].Instance;
+    return ((uint64_t)us * timer_clock(timer_num) + 500000 * (tim->PSC + 1)) / (1000000ULL * (tim->PSC + 1));
+}
+
+// Move every servo on the timer one step toward its target
+static void servo_update(uint8_t timer_num) {
+    TIM_HandleTypeDef* handle = &timer_handles[timer_num];
+    if (!__HAL_TIM_GET_FLAG(handle, TIM_FLAG_UPDATE)) {
+        return;
+    }
+    __HAL_TIM_CLEAR_FLAG(handle, TIM_FLAG_UPDATE);
+    bool moving = false;
+    for (int i = 0; i < MAX_SERVOS; i++) {
+        servo_t* servo = &servos[i];
+        if (!servo->gpio || servo->timer_num != timer_num || servo->position == servo->target) {
+            continue;
+        }
+        int32_t delta = servo->target - servo->position;
+        if (delta > (int32_t)servo->step) {
+            delta = servo->step;
+        } else if (delta < -(int32_t)servo->step) {
+            delta = -servo->step;
+        }
+        servo->position += delta;
+        *servo->ccr = (servo->position + 128) >> 8;
+        moving |= servo->position != servo->target;
+    }
+    if (!moving) {
+        __HAL_TIM_DISABLE_IT(handle, TIM_IT_UPDATE);
+    }
+}
+
+void TIM1_UP_IRQHandler(void) {
+    servo_update(1);
+}
+void TIM2_IRQHandler(void) {
+    servo_update(2);
+}
+void TIM3_IRQHandler(void) {
+    servo_update(3);
+}
+void TIM4_IRQHandler(void) {
+    servo_update(4);
+}
+
+bool PWM_Servo(const gpio_pin_t* gpio, uint32_t min_us, uint32_t max_us, uint32_t slew) {
+    uint8_t timer_num = pin_routes[gpio - gpio_map].timer_num;
+    if (!timer_num || min_us >= max_us) {
+        return false;
+    }
+    servo_t* servo = find_servo(gpio);
+    if (!servo && !(servo = find_servo(NULL))) {
+        return false;
+    }
+    TIM_TypeDef* tim    = timer_handles[timer_num].Instance;
+    uint32_t     period = tim->ARR + 1;
+    if (us_to_ticks(timer_num, max_us) > period) {
+        return false;  // The longest pulse would not fit in the frame
+    }
+    servo->timer_num = timer_num;
+    servo->ccr       = ccr_register(gpio);
+    servo->min       = us_to_ticks(timer_num, min_us);
+    servo->max       = us_to_ticks(timer_num, max_us);
+    // The period is 1/frequency, so a slew of slew us per second is
+    // slew * period / 1000000 ticks per period
+    servo->step     = ((uint64_t)slew * period << 8) / 1000000;
+    servo->position = 0;
+    servo->target   = 0;
+    if (slew && !servo->step) {
+        servo->step = 1;
+    }
+    servo->gpio = gpio;
+
+    HAL_NVIC_SetPriority(update_irqs[timer_num], 1, 0);
+    HAL_NVIC_EnableIRQ(update_irqs[timer_num]);
+    return true;
+}
+
+// Set a servo's target pulse width in ticks, clamped to its travel
+// limits.  The first move after configuration goes straight to the
+// target, because the servo's actual position is unknown.
+static void servo_move(servo_t* servo, uint32_t ticks) {
+    if (ticks < servo->min) {
+        ticks = servo->min;
+    } else if (ticks > servo->max) {
+        ticks = servo->max;
+    }
+    IRQn_Type irqn = update_irqs[servo->timer_num];
+    HAL_NVIC_DisableIRQ(irqn);
+    servo->target = ticks << 8;
+    if (!servo->step || !servo->position) {
+        servo->position = servo->target;
+        *servo->ccr     = ticks;
+    } else if (servo->position != servo->target) {
+        __HAL_TIM_ENABLE_IT(&timer_handles[servo->timer_num], TIM_IT_UPDATE);
+    }
+    HAL_NVIC_EnableIRQ(irqn);
+}
+
+bool PWM_Servo_Move(const gpio_pin_t* gpio, uint32_t pulse_us) {
+    servo_t* servo = find_servo(gpio);
+    if (!servo) {
+        return false;
+    }
+    servo_move(servo, us_to_ticks(servo->timer_num, pulse_us));
+    return true;
+}
+
+static void servo_release(const gpio_pin_t* gpio) {
+    servo_t* servo = find_servo(gpio);
+    if (servo) {
+        IRQn_Type irqn = update_irqs[servo->timer_num];
+        HAL_NVIC_DisableIRQ(irqn);
+        servo->gpio = NULL;
+        HAL_NVIC_EnableIRQ(irqn);
+    }
+}
+
+// PWM ramps.  The timer update event triggers a DMA transfer that
+// copies the next duty value from a circular ring into the channel's
+// CCR register, so the duty changes once per PWM period with no CPU
+// involvement.  A ramp can be longer than the ring, so the DMA half
+// and full interrupts refill the half that was just sent with the next
+// values of the curve.  The CCR preload makes each new value take
+// effect at the start of a period, so there are no glitches.
+//
+// On the F103 the update DMA requests of TIM1 and TIM4 share channels
+// with the USART1 receive and USART2 transmit DMA, so only TIM2 and TIM3
+// can ramp.  One channel of each timer can ramp at a time.
+typedef struct {
+    DMA_HandleTypeDef  hdma;  // Must be first; see ramp_half_done()
+    uint8_t            timer_num;
+    IRQn_Type          irqn;
+    uint16_t*          buf;
+    volatile uint32_t* ccr;    // Register being ramped, NULL if idle
+    uint32_t           steps;  // PWM periods in the ramp
+    uint32_t           next;   // Step number of the next value to compute
+    int32_t            from;
+    int32_t            to;
+    uint8_t            curve;
+    bool               finishing;  // A half of the ring holds only the target value
+} pwm_ramp_t;
+
+static pwm_ramp_t ramps[RAMP_TIMERS] = {
+    { .hdma = { .Instance = DMA1_Channel2 }, .timer_num = 2, .irqn = DMA1_Channel2_IRQn },
+    { .hdma = { .Instance = DMA1_Channel3 }, .timer_num = 3, .irqn = DMA1_Channel3_IRQn },
+};
+
+static pwm_ramp_t* find_ramp(uint8_t timer_num) {
+    for (int i = 0; i < RAMP_TIMERS; i++) {
+        if (ramps[i].timer_num == timer_num) {
+            return &ramps[i];
+        }
+    }
+    return NULL;
+}
+
+// The duty value for a step of the ramp, step 0 being the starting value
+static uint16_t ramp_value(pwm_ramp_t* ramp, uint32_t step) {
+    if (step >= ramp->steps) {
+        return ramp->to;
+    }
+    // Fraction of the ramp time in 16-bit fixed point
+    uint32_t x = ((uint64_t)step << 16) / ramp->steps;
+    if (ramp->curve == RAMP_S) {
+        x = ((uint64_t)x * x * (3 * 0x10000 - 2 * x)) >> 32;  // 3x^2 - 2x^3
+    }
+    return ramp->from + (((int64_t)(ramp->to - ramp->from) * x) >> 16);
+}
+
+static void ramp_fill(pwm_ramp_t* ramp, uint16_t* values) {
+    if (ramp->next >= ramp->steps) {
+        ramp->finishing = true;
+    }
+    for (int i = 0; i < RAMP_BUF_LEN / 2; i++) {
+        values[i] = ramp_value(ramp, ramp->next);
+        if (ramp->next < ramp->steps) {
+            ++ramp->next;
+        }
+    }
+}
+
+// Stop the DMA and leave the CCR register at its present value
+static void ramp_stop(pwm_ramp_t* ramp) {
+    if (!ramp->ccr) {
+        return;
+    }
+    __HAL_TIM_DISABLE_DMA(&timer_handles[ramp->timer_num], TIM_DMA_UPDATE);
+    HAL_DMA_Abort(&ramp->hdma);
+    ramp->ccr = NULL;
+}
+
+// DMA half and full transfer callbacks.  Once the other half holds only
+// the target, the half that was just sent had the last values of the
+// ramp, so the ring can stop.
+static void ramp_refill(DMA_HandleTypeDef* hdma, uint16_t* values) {
+    pwm_ramp_t* ramp = (pwm_ramp_t*)hdma;
+    if (ramp->finishing) {
+        volatile uint32_t* ccr = ramp->ccr;
+        ramp_stop(ramp);
+        *ccr = ramp->to;
+        return;
+    }
+    ramp_fill(ramp, values);
+}
+static void ramp_half_done(DMA_HandleTypeDef* hdma) {
+    ramp_refill(hdma, ((pwm_ramp_t*)hdma)->buf);
+}
+static void ramp_done(DMA_HandleTypeDef* hdma) {
+    ramp_refill(hdma, ((pwm_ramp_t*)hdma)->buf + RAMP_BUF_LEN / 2);
+}
+
+void DMA1_Channel2_IRQHandler(void) {
+    HAL_DMA_IRQHandler(&ramps[0].hdma);
+}
+void DMA1_Channel3_IRQHandler(void) {
+    HAL_DMA_IRQHandler(&ramps[1].hdma);
+}
+
+// Cancel any ramp on the pin's channel, leaving the duty where it is
+static void ramp_cancel(const gpio_pin_t* gpio) {
+    pwm_ramp_t* ramp = find_ramp(pin_routes[gpio - gpio_map].timer_num);
+    if (ramp && ramp->ccr == ccr_register(gpio)) {
+        HAL_NVIC_DisableIRQ(ramp->irqn);
+        ramp_stop(ramp);
+        HAL_NVIC_EnableIRQ(ramp->irqn);
+    }
+}
+
+bool PWM_Ramp(const gpio_pin_t* gpio, uint32_t numerator, uint32_t denominator, uint32_t ms, uint8_t curve) {
+    uint8_t timer_num = pin_routes[gpio - gpio_map].timer_num;
+    if (!timer_num || find_servo(gpio) || numerator > denominator || !denominator) {
+        return false;
+    }
+    pwm_ramp_t* ramp = find_ramp(timer_num);
+    if (!ramp) {
+        return false;
+    }
+    TIM_HandleTypeDef* handle = &timer_handles[timer_num];
+    TIM_TypeDef*       tim    = handle->Instance;
+
+    // A new ramp on the timer replaces the one in progress, even on
+    // another channel, which stays at its present duty
+    HAL_NVIC_DisableIRQ(ramp->irqn);
+    ramp_stop(ramp);
+    HAL_NVIC_EnableIRQ(ramp->irqn);
+
+    if (!ramp->buf) {
+        ramp->buf = pool_alloc(RAMP_BUF_LEN * sizeof(uint16_t));
+        if (!ramp->buf) {
+            return false;
+        }
+        __HAL_RCC_DMA1_CLK_ENABLE();
+        DMA_HandleTypeDef* hdma        = &ramp->hdma;
+        hdma->Init.Direction           = DMA_MEMORY_TO_PERIPH;
+        hdma->Init.PeriphInc           = DMA_PINC_DISABLE;
+        hdma->Init.MemInc              = DMA_MINC_ENABLE;
+        hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+        hdma->Init.MemDataAlignment    = DMA_MDATAALIGN_HALFWORD;
+        hdma->Init.Mode                = DMA_CIRCULAR;
+        hdma->Init.Priority            = DMA_PRIORITY_LOW;
+        if (HAL_DMA_Init(hdma) != HAL_OK) {
+            return false;
+        }
+        hdma->XferHalfCpltCallback = ramp_half_done;
+        hdma->XferCpltCallback     = ramp_done;
+        HAL_NVIC_SetPriority(ramp->irqn, 0, 0);
+    }
+
+    uint32_t period = tim->ARR + 1;
+    uint64_t ticks  = (uint64_t)(tim->PSC + 1) * period * 1000;
+
+    volatile uint32_t* ccr = ccr_register(gpio);
+    ramp->from             = *ccr;
+    ramp->to               = (uint64_t)numerator * period / denominator;
+    ramp->steps            = (uint64_t)ms * timer_clock(timer_num) / ticks;
+    ramp->curve            = curve;
+    ramp->next             = 1;
+    ramp->finishing        = false;
+    if (ramp->steps < 2) {
+        *ccr = ramp->to;
+        return true;
+    }
+
+    ramp_fill(ramp, ramp->buf);
+    ramp_fill(ramp, ramp->buf + RAMP_BUF_LEN / 2);
+    ramp->ccr = ccr;
+    if (HAL_DMA_Start_IT(&ramp->hdma, (uint32_t)ramp->buf, (uint32_t)ccr, RAMP_BUF_LEN) != HAL_OK) {
+        ramp->ccr = NULL;
+        return false;
+    }
+    HAL_NVIC_EnableIRQ(ramp->irqn);
+    __HAL_TIM_ENABLE_DMA(handle, TIM_DMA_UPDATE);
+    return true;
+}
+
+// Set the duty cycle to numerator/denominator of the period.  For a
+// servo it is the position as a fraction of the travel.
+void PWM_Duty(const gpio_pin_t* gpio, uint32_t numerator, uint32_t denominator) {
+    uint8_t timer_num = pin_routes[gpio - gpio_map].timer_num;
+    if (!timer_num) {
+        return;
+    }
+    servo_t* servo = find_servo(gpio);
+    if (servo) {
+        servo_move(servo, servo->min + (denominator ? (uint64_t)numerator * (servo->max - servo->min) / denominator : 0));
+        return;
+    }
+    ramp_cancel(gpio);
+    TIM_TypeDef* tim    = timer_handles[timer_num].Instance;
+    *ccr_register(gpio) = denominator ? (uint64_t)numerator * (tim->ARR + 1) / denominator : 0;
+}
+void deinit_pwm(const gpio_pin_t* gpio) {
+    pwm_route_t* route = &pin_routes[gpio - gpio_map];
+    if (!route->timer_num || (route->n_output && complement_gpios[route->channel] == gpio)) {
+        return;  // Not driven, or the CHxN pin of another pin's channel
+    }
+    servo_release(gpio);
+    ramp_cancel(gpio);
+    complement_stop(gpio);
+    uint8_t            timer_num = route->timer_num;
+    uint32_t           channel   = timer_channels[route->channel];
+    TIM_HandleTypeDef* handle    = &timer_handles[timer_num];
+    if (route->n_output) {
+        HAL_TIMEx_PWMN_Stop(handle, channel);
+    } else {
+        HAL_TIM_PWM_Stop(handle, channel);
+    }
+    // The timer keeps its frequency while other pins are using it
+    if (--timer_users[timer_num] == 0) {
+        timer_frequencies[timer_num] = 0;
     }
+    route->timer_num = 0;
 }
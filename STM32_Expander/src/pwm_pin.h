@@ -1,3 +1,9 @@
 #include "pin.h"
-bool PWM_Init(gpio_pin_t* gpio, uint32_t frequency, bool invert);
-void PWM_Duty(gpio_pin_t* gpio, uint32_t duty);
+bool PWM_Init(const gpio_pin_t* gpio, uint32_t frequency, bool invert);
+void PWM_Duty(const gpio_pin_t* gpio, uint32_t numerator, uint32_t denominator);
+bool PWM_Complementary(const gpio_pin_t* gpio, uint32_t deadtime_ns, uint8_t brk);
+bool PWM_Ramp(const gpio_pin_t* gpio, uint32_t numerator, uint32_t denominator, uint32_t ms, uint8_t curve);
+bool PWM_Info(const gpio_pin_t* gpio, uint32_t* frequency, uint32_t* steps);
+bool PWM_Conflict(const gpio_pin_t* gpio, uint8_t* other_pin, uint32_t* frequency);
+bool PWM_Servo(const gpio_pin_t* gpio, uint32_t min_us, uint32_t max_us, uint32_t slew);
+bool PWM_Servo_Move(const gpio_pin_t* gpio, uint32_t pulse_us);
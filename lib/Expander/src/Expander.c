@@ -12,6 +12,8 @@
 extern "C" {
 #endif
 
+extern int milliseconds();
+
 // The integer value for
 // pin low reports is 0x100 to 0x13f, and for
 // pin high reports is 0x140 to 0x17f
@@ -42,61 +44,97 @@ void expander_pin_msg(uint8_t pin_num, bool active) {
     fnc_putchar(0x80 + pin_num);
 }
 
-pin_mode_t parse_io_mode(char* params) {
-    pin_mode_t mode = 0;
-    for (char* rest; *params; params = rest) {
-        split(params, &rest, ',');
-        if (strcasecmp(params, "low") == 0) {
-            mode |= PIN_ACTIVELOW;
-            continue;
-        }
-        if (strcasecmp(params, "out") == 0) {
-            mode |= PIN_OUTPUT;
-            continue;
-        }
-        if (strcasecmp(params, "in") == 0) {
-            mode |= PIN_INPUT;
-            continue;
-        }
-        if (strcasecmp(params, "pwm") == 0) {
-            mode |= PIN_PWM;
-            continue;
-        }
-        if (strcasecmp(params, "pu") == 0) {
-            mode |= PIN_PULLUP;
-            continue;
-        }
-        if (strcasecmp(params, "pd") == 0) {
-            mode |= PIN_PULLDOWN;
-            continue;
-        }
-        if (strncasecmp(params, "frequency=", strlen("frequency=")) == 0) {
-            int freq = atoi(params + strlen("frequency="));
-            mode |= freq << PIN_FREQ_SHIFT;
-            continue;
+// Send an extended code in the range 0x10000..0x10ffff as 4 UTF8 bytes
+static void expander_send_code(uint32_t code) {
+    fnc_putchar(0xf0 | (code >> 18));
+    fnc_putchar(0x80 | ((code >> 12) & 0x3f));
+    fnc_putchar(0x80 | ((code >> 6) & 0x3f));
+    fnc_putchar(0x80 | (code & 0x3f));
+}
+
+// In bitmap report mode, the pin changes from one pass over the inputs
+// are collected and then sent as one frame of PinGroupReport codes, one
+// code for each group of 8 pins that has changes.  The value is
+// 0x80000 + (group << 16) + (changed << 8) + values, where changed has
+// a bit set for each pin in the group whose state is being reported and
+// values has the states of those pins.  This is the same layout as the
+// SetOutputs command in the other direction.
+#define PinGroupReport 0x80000
+
+// In the timestamped report modes, each pin message or bitmap frame is
+// followed by the time at which the change was seen, in microseconds.
+// REPORT_TIME_ABS sends the absolute time as two codes, TimeHighReport
+// with bits 18..31 followed by TimeLowReport with bits 0..17.
+// REPORT_TIME_DELTA sends only TimeLowReport, containing the time since
+// the previous report, saturated at 0x3ffff (about 262 ms).
+#define TimeHighReport 0x20000
+#define TimeLowReport 0x40000
+#define TimeLowMask 0x3ffff
+
+static uint8_t    report_mode        = 0;
+static exp_pins_t bitmap_changed     = 0;
+static exp_pins_t bitmap_values      = 0;
+static uint32_t   bitmap_micros      = 0;
+static uint32_t   last_report_micros = 0;
+
+static void send_timestamp(uint32_t micros) {
+    if (report_mode & REPORT_TIME_ABS) {
+        expander_send_code(TimeHighReport + (micros >> 18));
+        expander_send_code(TimeLowReport + (micros & TimeLowMask));
+    } else if (report_mode & REPORT_TIME_DELTA) {
+        uint32_t delta = micros - last_report_micros;
+        if (delta > TimeLowMask) {
+            delta = TimeLowMask;
         }
+        expander_send_code(TimeLowReport + delta);
     }
-    return mode;
+    last_report_micros = micros;
 }
 
-static void trim(char** str) {
-    char* s = *str;
-    while (isspace(*s)) {
-        ++s;
+static void timed_pin_msg(uint8_t pin_num, bool active) {
+    expander_pin_msg(pin_num, active);
+    send_timestamp(pin_change_micros(pin_num));
+}
+
+static void collect_pin_msg(uint8_t pin_num, bool active) {
+    if (!bitmap_changed) {
+        bitmap_micros = pin_change_micros(pin_num);  // The frame time is that of its first change
     }
-    char* p = s + strlen(s);
-    while (p != s && isspace(p[-1])) {
-        --p;
+    exp_pins_t bit = (exp_pins_t)1 << pin_num;
+    bitmap_changed |= bit;
+    if (active) {
+        bitmap_values |= bit;
+    } else {
+        bitmap_values &= ~bit;
     }
-    *p   = '\0';
-    *str = s;
 }
 
-static void expander_ack_nak(bool okay, const char* errmsg) {
-    if (okay) {
-        expander_ack();
-    } else {
-        expander_nak(errmsg);
+// The function that the pin layer should call to report a pin state
+static pin_msg_t pin_reporter() {
+    if (report_mode & REPORT_BITMAP) {
+        return collect_pin_msg;
+    }
+    return (report_mode & (REPORT_TIME_ABS | REPORT_TIME_DELTA)) ? timed_pin_msg : expander_pin_msg;
+}
+
+// Send any pin states that pin_reporter() has collected
+static void flush_pin_reports() {
+    if (!bitmap_changed) {
+        return;
+    }
+    uint32_t micros = bitmap_micros;
+    for (uint8_t group = 0; bitmap_changed; group++) {
+        uint8_t changed = bitmap_changed & 0xff;
+        if (changed) {
+            uint8_t values = bitmap_values & 0xff;
+            expander_send_code(PinGroupReport + ((uint32_t)group << 16) + ((uint32_t)changed << 8) + values);
+        }
+        bitmap_changed >>= 8;
+        bitmap_values >>= 8;
+    }
+    bitmap_values = 0;
+    if (report_mode & (REPORT_TIME_ABS | REPORT_TIME_DELTA)) {
+        send_timestamp(micros);
     }
 }
 
@@ -120,10 +158,28 @@ void expander_report_info() {
 #define PinHighFirst 0x140
 #define PinHighLast 0x17f
 #define SetPWM 0x10000
+#define SetPWMLast 0x1ffff
+// SetOutputs writes up to 8 outputs in one group at the same time.
+// The value is 0x80000 + (group << 16) + (mask << 8) + values, where
+// group 0..7 selects pins group*8 .. group*8+7, and for each bit set
+// in mask the corresponding bit in values is the new output state.
+// It encodes to 4 UTF8 bytes, versus 2 bytes per pin for PinLow/PinHigh.
+#define SetOutputs 0x80000
+#define SetOutputsLast 0xfffff
 void handle_extended_command(uint32_t cmd) {
     uint32_t value;
     int      pin_num;
-    if (cmd >= SetPWM) {
+    if (cmd >= SetOutputs && cmd <= SetOutputsLast) {
+        value          = cmd - SetOutputs;
+        uint8_t group  = value >> 16;
+        uint8_t mask   = value >> 8;
+        uint8_t values = value;
+        if (set_outputs(group * 8, mask, values)) {
+            expander_nak("Cannot set outputs");
+        }
+        return;
+    }
+    if (cmd >= SetPWM && cmd <= SetPWMLast) {
         value   = cmd - SetPWM;
         pin_num = value >> 10;
         value   = value & 0x3ff;
@@ -142,60 +198,829 @@ void handle_extended_command(uint32_t cmd) {
     }
 }
 
-bool expander_handle_command(char* command) {
-    size_t len = strlen(command);
-    if (!len) {
-        return false;
+// Single-pass parser for expander command lines.
+// Examples:
+//   [MSG:RST]
+//   [EXP:ID]
+//   [EXP: io.N=out,low]
+//   [EXP: io.N=in,pu]
+//   [EXP: io.N=in,irq]         Input captured by interrupt if possible
+//   [EXP: io.N=in,debounce=5,filter=stable]  Debounce time in ms and filter type
+//   [EXP: io.N=pwm,frequency=5000]
+//   [EXP: io.N=pwm,frequency=20000,complementary,deadtime=500,break=low]
+//   [EXP: io.N=servo,frequency=50,min=1000,max=2000,slew=500]  Limits in us, slew in us/s
+//   [EXP: io.0-7=in,pu]         Range of pins
+//   [EXP: io.1,3,5,8-11=out]   List of pins and ranges
+//   [EXP: REPORT=bitmap]       Input report format
+//   [EXP: REPORT=pin,time=abs] Input report format with timestamps
+//   [EXP: BAUD=2000000]        Change the baud rate of the link
+//   [EXP: ramp.N=750,time=2000,curve=s]  Ramp PWM duty to 750/1000 over 2 seconds
+//   [EXP: servo.N=1500]        Servo pulse width in us
+// The scanner walks the line once, dispatching on each prefix as soon
+// as it is seen, so lines that are not for the expander are rejected
+// after looking at only a few characters.
+
+// Case-insensitive comparison of a token of length len to a lower-case word
+static bool token_is(const char* token, size_t len, const char* word) {
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)token[i]) != word[i]) {
+            return false;
+        }
     }
-    if (strcmp(command, "[MSG:RST]") == 0) {
-        expander_rst();
-        return false;  // This message is not specific to the expander
+    return word[len] == '\0';
+}
+
+// If *p begins with prefix, advance *p past it and return true
+static bool skip_prefix(const char** p, const char* prefix) {
+    const char* s = *p;
+    while (*prefix) {
+        if (*s++ != *prefix++) {
+            return false;
+        }
     }
+    *p = s;
+    return true;
+}
 
-    if (command[len - 1] != ']') {
-        return false;
+static const char* skip_blanks(const char* p) {
+    while (*p == ' ' || *p == '\t') {
+        ++p;
     }
+    return p;
+}
 
-    // EXP operation examples:
-    //   [EXP: io.N=out,low]
-    //   [EXP: io.N=inp,pu]
-    //   [EXP: io.N=pwm]
-    if (strncmp(command, "[EXP:", 5) != 0) {
+// Parse a number up to max.  All of its digits are skipped, but it is
+// only accumulated while it fits.  Returns false if there are no digits
+// or the number is too big.
+static bool parse_uint(const char** p, uint32_t max, uint32_t* n) {
+    const char* s     = *p;
+    uint32_t    value = 0;
+    bool        fits  = true;
+    while (*s >= '0' && *s <= '9') {
+        uint32_t digit = *s++ - '0';
+        if (fits && value > (max - digit) / 10) {
+            fits = false;
+        }
+        if (fits) {
+            value = value * 10 + digit;
+        }
+    }
+    bool ok = fits && s != *p;
+    *p      = s;
+    if (ok) {
+        *n = value;
+    }
+    return ok;
+}
+
+// A line is an expander command only if it ends with ']', possibly followed by blanks.
+// Returns false if the remainder of the line does not end that way.
+static bool at_close(const char* p) {
+    p = skip_blanks(p);
+    return *p == ']' && p[1] == '\0';
+}
+
+// On a parse error, scan to the end of the line to determine whether it
+// was a well-formed expander command (which gets a NAK) or something else.
+static bool parse_error(const char* p, exp_cmd_t* cmd, const char* errmsg) {
+    const char* last = p;
+    for (; *p; ++p) {
+        if (*p != ' ' && *p != '\t') {
+            last = p;
+        }
+    }
+    if (*last != ']') {
+        cmd->type = exp_cmd_none;
         return false;
     }
-    // Now we know that the command is for the expander so it is okay to modify the string
-    command[len - 1] = '\0';
+    cmd->type   = exp_cmd_error;
+    cmd->errmsg = errmsg;
+    return true;
+}
+
+// Parse a pin list like 3 or 0-7 or 1,3,5,8-11 into cmd->pins
+static bool parse_pin_list(const char** pp, exp_cmd_t* cmd) {
+    const char* p = *pp;
+    while (true) {
+        uint32_t first, last;
+        p = skip_blanks(p);
+        if (!parse_uint(&p, EXP_MAX_PINS - 1, &first)) {
+            return false;
+        }
+        last = first;
+        p    = skip_blanks(p);
+        if (*p == '-') {
+            p = skip_blanks(p + 1);
+            if (!parse_uint(&p, EXP_MAX_PINS - 1, &last)) {
+                return false;
+            }
+            p = skip_blanks(p);
+        }
+        if (last < first) {
+            return false;
+        }
+        for (uint32_t pin_num = first; pin_num <= last; pin_num++) {
+            cmd->pins |= (exp_pins_t)1 << pin_num;
+        }
+        if (*p != ',') {
+            break;
+        }
+        ++p;
+    }
+    *pp = p;
+    return true;
+}
 
-    char* pinspec;
-    split(command, &pinspec, ':');
+// One element of a comma-separated list, either a bare word or key=value
+typedef struct {
+    const char* word;
+    size_t      len;    // Length of the word, or of the key if value is set
+    const char* value;  // Start of the value after =, or NULL
+    size_t      vlen;   // Length of the value
+} token_t;
 
-    if (strcmp(pinspec, "ID") == 0) {
-        expander_report_info();
+// Scan one list element, returning a pointer to the , or ] that ends it
+static const char* next_token(const char* p, token_t* tok) {
+    p               = skip_blanks(p);
+    tok->word       = p;
+    tok->value      = NULL;
+    tok->vlen       = 0;
+    const char* end = NULL;
+    while (*p && *p != ',' && *p != ']') {
+        if (*p == '=' && !tok->value) {
+            end        = p;
+            tok->value = skip_blanks(p + 1);
+        }
+        ++p;
+    }
+    if (!end) {
+        end = p;
     }
+    while (end != tok->word && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    tok->len = end - tok->word;
+    if (tok->value) {
+        end = p;
+        while (end != tok->value && (end[-1] == ' ' || end[-1] == '\t')) {
+            --end;
+        }
+        tok->vlen = end - tok->value;
+    }
+    return p;
+}
 
-    char* params;
-    split(pinspec, &params, '=');
+// True if the whole value of a key=value token is word
+static bool value_is(const token_t* tok, const char* word) {
+    return token_is(tok->value, tok->vlen, word);
+}
 
-    trim(&pinspec);  // Remove leading and trailing blanks
-    trim(&params);   // Remove leading and trailing blanks
+// Parse the whole value of a key=value token as a number up to max.
+// Returns false if it is empty, has other characters, or is too big.
+static bool parse_value(const token_t* tok, uint32_t max, uint32_t* n) {
+    const char* v = tok->value;
+    return parse_uint(&v, max, n) && v == tok->value + tok->vlen;
+}
 
-    size_t prefixlen = strlen("io.");
-    if (strncmp(pinspec, "io.", prefixlen) != 0) {
-        expander_nak("Missing io. specifier");
-        return true;
+// Parse the comma-separated mode list after io.N=
+static bool parse_io_mode(const char* p, exp_cmd_t* cmd) {
+    pin_mode_t mode = 0;
+    while (true) {
+        token_t tok;
+        p = next_token(p, &tok);
+        if (tok.value) {
+            uint32_t n;
+            if (token_is(tok.word, tok.len, "frequency")) {
+                if (!parse_value(&tok, UINT32_MAX >> PIN_FREQ_SHIFT, &n)) {
+                    return parse_error(p, cmd, "Bad frequency");
+                }
+                mode |= (pin_mode_t)n << PIN_FREQ_SHIFT;
+            } else if (token_is(tok.word, tok.len, "min")) {
+                if (!parse_value(&tok, 0xffff, &n)) {
+                    return parse_error(p, cmd, "Bad servo min");
+                }
+                cmd->min_us = n;
+            } else if (token_is(tok.word, tok.len, "max")) {
+                if (!parse_value(&tok, 0xffff, &n)) {
+                    return parse_error(p, cmd, "Bad servo max");
+                }
+                cmd->max_us = n;
+            } else if (token_is(tok.word, tok.len, "slew")) {
+                if (!parse_value(&tok, UINT32_MAX, &cmd->slew)) {
+                    return parse_error(p, cmd, "Bad slew");
+                }
+            } else if (token_is(tok.word, tok.len, "deadtime")) {
+                if (!parse_value(&tok, 0xffff, &n)) {
+                    return parse_error(p, cmd, "Bad deadtime");
+                }
+                cmd->deadtime_ns = n;
+            } else if (token_is(tok.word, tok.len, "break")) {
+                if (value_is(&tok, "low")) {
+                    cmd->brk = BREAK_LOW;
+                } else if (value_is(&tok, "high")) {
+                    cmd->brk = BREAK_HIGH;
+                } else if (value_is(&tok, "off")) {
+                    cmd->brk = BREAK_NONE;
+                } else {
+                    return parse_error(p, cmd, "Bad break mode");
+                }
+            } else if (token_is(tok.word, tok.len, "debounce")) {
+                if (!parse_value(&tok, 0xffff, &n)) {
+                    return parse_error(p, cmd, "Bad debounce");
+                }
+                cmd->debounce_ms = n;
+            } else if (token_is(tok.word, tok.len, "filter")) {
+                if (value_is(&tok, "edge")) {
+                    cmd->filter = filter_edge;
+                } else if (value_is(&tok, "stable")) {
+                    cmd->filter = filter_stable;
+                } else if (value_is(&tok, "count")) {
+                    cmd->filter = filter_count;
+                } else {
+                    return parse_error(p, cmd, "Bad filter");
+                }
+            } else {
+                return parse_error(p, cmd, "Unknown mode option");
+            }
+        } else {
+            switch (tok.len) {
+                case 2:
+                    if (token_is(tok.word, tok.len, "in")) {
+                        mode |= PIN_INPUT;
+                    } else if (token_is(tok.word, tok.len, "pu")) {
+                        mode |= PIN_PULLUP;
+                    } else if (token_is(tok.word, tok.len, "pd")) {
+                        mode |= PIN_PULLDOWN;
+                    }
+                    break;
+                case 3:
+                    if (token_is(tok.word, tok.len, "low")) {
+                        mode |= PIN_ACTIVELOW;
+                    } else if (token_is(tok.word, tok.len, "out")) {
+                        mode |= PIN_OUTPUT;
+                    } else if (token_is(tok.word, tok.len, "pwm")) {
+                        mode |= PIN_PWM;
+                    } else if (token_is(tok.word, tok.len, "irq")) {
+                        mode |= PIN_IRQ;
+                    }
+                    break;
+                case 5:
+                    if (token_is(tok.word, tok.len, "servo")) {
+                        mode |= PIN_PWM | PIN_SERVO;
+                    }
+                    break;
+                case 13:
+                    if (token_is(tok.word, tok.len, "complementary")) {
+                        mode |= PIN_COMPLEMENTARY;
+                    }
+                    break;
+            }
+            // Unknown mode words are ignored
+        }
+        if (*p != ',') {
+            break;
+        }
+        ++p;
     }
+    if (!at_close(p)) {
+        return parse_error(p, cmd, "Bad mode list");
+    }
+    if (mode & PIN_SERVO) {
+        if (cmd->min_us >= cmd->max_us) {
+            return parse_error(p, cmd, "Bad servo limits");
+        }
+        if (!(mode >> PIN_FREQ_SHIFT)) {
+            mode |= (pin_mode_t)SERVO_FREQUENCY << PIN_FREQ_SHIFT;
+        }
+    }
+    cmd->type = exp_cmd_io;
+    cmd->mode = mode;
+    return true;
+}
 
-    char* pin_str = pinspec + prefixlen;
-    int   pin_num = atoi(pin_str);  // Will be 0 if pin_str is "*"
+// Parse the list after REPORT=
+static bool parse_report_mode(const char* p, exp_cmd_t* cmd) {
+    uint8_t report = 0;
+    while (true) {
+        token_t tok;
+        p = next_token(p, &tok);
+        if (tok.value && token_is(tok.word, tok.len, "time")) {
+            if (value_is(&tok, "abs")) {
+                report |= REPORT_TIME_ABS;
+            } else if (value_is(&tok, "delta")) {
+                report |= REPORT_TIME_DELTA;
+            } else if (!value_is(&tok, "off")) {
+                return parse_error(p, cmd, "Bad report time");
+            }
+        } else if (token_is(tok.word, tok.len, "bitmap")) {
+            report |= REPORT_BITMAP;
+        } else if (!token_is(tok.word, tok.len, "pin")) {
+            return parse_error(p, cmd, "Bad report mode");
+        }
+        if (*p != ',') {
+            break;
+        }
+        ++p;
+    }
+    if (!at_close(p)) {
+        return parse_error(p, cmd, "Bad report mode");
+    }
+    cmd->type   = exp_cmd_report;
+    cmd->report = report;
+    return true;
+}
+
+// Parse the list after ramp.N=, which begins with the target duty
+static bool parse_ramp(const char* p, exp_cmd_t* cmd) {
+    uint32_t duty;
+    p = skip_blanks(p);
+    if (!parse_uint(&p, RAMP_DUTY_MAX, &duty)) {
+        return parse_error(p, cmd, "Bad ramp duty");
+    }
+    p = skip_blanks(p);
+    while (*p == ',') {
+        token_t tok;
+        p = next_token(p + 1, &tok);
+        if (!tok.value) {
+            return parse_error(p, cmd, "Bad ramp option");
+        }
+        if (token_is(tok.word, tok.len, "time")) {
+            if (!parse_value(&tok, UINT32_MAX, &cmd->ramp_ms)) {
+                return parse_error(p, cmd, "Bad ramp time");
+            }
+        } else if (token_is(tok.word, tok.len, "curve")) {
+            if (value_is(&tok, "linear")) {
+                cmd->curve = RAMP_LINEAR;
+            } else if (value_is(&tok, "s")) {
+                cmd->curve = RAMP_S;
+            } else {
+                return parse_error(p, cmd, "Bad ramp curve");
+            }
+        } else {
+            return parse_error(p, cmd, "Bad ramp option");
+        }
+    }
+    if (!at_close(p)) {
+        return parse_error(p, cmd, "Bad ramp");
+    }
+    cmd->type = exp_cmd_ramp;
+    cmd->duty = duty;
+    return true;
+}
 
-    bool res = expander_ini(pin_num, parse_io_mode(params));
-    expander_ack_nak(res, "EXP Error");
-    if (res) {
-        expander_get(pin_num);
+// Parse the pulse width after servo.N=
+static bool parse_servo(const char* p, exp_cmd_t* cmd) {
+    uint32_t us;
+    p = skip_blanks(p);
+    if (!parse_uint(&p, 0xffff, &us) || !at_close(p)) {
+        return parse_error(p, cmd, "Bad servo pulse width");
     }
+    cmd->type     = exp_cmd_servo;
+    cmd->pulse_us = us;
     return true;
 }
 
+bool expander_parse_command(const char* p, exp_cmd_t* cmd) {
+    cmd->type        = exp_cmd_none;
+    cmd->pins        = 0;
+    cmd->mode        = 0;
+    cmd->filter      = filter_edge;
+    cmd->debounce_ms = DEFAULT_DEBOUNCE_MS;
+    cmd->report      = 0;
+    cmd->deadtime_ns = 0;
+    cmd->brk         = BREAK_NONE;
+    cmd->baud        = 0;
+    cmd->duty        = 0;
+    cmd->curve       = RAMP_LINEAR;
+    cmd->ramp_ms     = 0;
+    cmd->min_us      = SERVO_MIN_US;
+    cmd->max_us      = SERVO_MAX_US;
+    cmd->slew        = 0;
+    cmd->pulse_us    = 0;
+    cmd->errmsg      = NULL;
+
+    if (*p++ != '[') {
+        return false;
+    }
+    if (*p == 'M') {
+        if (skip_prefix(&p, "MSG:RST]") && *p == '\0') {
+            cmd->type = exp_cmd_rst;
+            return true;
+        }
+        return false;
+    }
+    if (!skip_prefix(&p, "EXP:")) {
+        return false;
+    }
+
+    p = skip_blanks(p);
+    if (skip_prefix(&p, "ID")) {
+        if (!at_close(p)) {
+            return parse_error(p, cmd, "Bad ID command");
+        }
+        cmd->type = exp_cmd_id;
+        return true;
+    }
+    if (skip_prefix(&p, "STATS")) {
+        if (!at_close(p)) {
+            return parse_error(p, cmd, "Bad STATS command");
+        }
+        cmd->type = exp_cmd_stats;
+        return true;
+    }
+    if (skip_prefix(&p, "REPORT")) {
+        p = skip_blanks(p);
+        if (*p != '=') {
+            return parse_error(p, cmd, "Missing =");
+        }
+        return parse_report_mode(p + 1, cmd);
+    }
+    if (skip_prefix(&p, "BAUD")) {
+        p = skip_blanks(p);
+        if (*p++ != '=') {
+            return parse_error(p - 1, cmd, "Missing =");
+        }
+        if (!parse_uint(&p, UINT32_MAX, &cmd->baud) || !cmd->baud || !at_close(p)) {
+            return parse_error(p, cmd, "Bad baud rate");
+        }
+        cmd->type = exp_cmd_baud;
+        return true;
+    }
+    if (skip_prefix(&p, "ramp.")) {
+        if (!parse_pin_list(&p, cmd)) {
+            return parse_error(p, cmd, "Bad pin number");
+        }
+        if (*p != '=') {
+            return parse_error(p, cmd, "Missing =");
+        }
+        return parse_ramp(p + 1, cmd);
+    }
+    if (skip_prefix(&p, "servo.")) {
+        if (!parse_pin_list(&p, cmd)) {
+            return parse_error(p, cmd, "Bad pin number");
+        }
+        if (*p != '=') {
+            return parse_error(p, cmd, "Missing =");
+        }
+        return parse_servo(p + 1, cmd);
+    }
+    if (!skip_prefix(&p, "io.")) {
+        return parse_error(p, cmd, "Missing io. specifier");
+    }
+    if (*p == '*') {
+        ++p;  // For compatibility, io.* means pin 0
+        cmd->pins = 1;
+    } else if (!parse_pin_list(&p, cmd)) {
+        return parse_error(p, cmd, "Bad pin number");
+    }
+    p = skip_blanks(p);
+    if (*p != '=') {
+        return parse_error(p, cmd, "Missing =");
+    }
+    return parse_io_mode(p + 1, cmd);
+}
+
+static char* append_uint(char* p, uint32_t n) {
+    char  digits[10];
+    char* d = digits;
+    do {
+        *d++ = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (d != digits) {
+        *p++ = *--d;
+    }
+    *p = '\0';
+    return p;
+}
+
+// Append a pin set in the same form that the parser accepts, e.g. 1,3,8-11,
+// truncating it with ... if it does not fit in the buffer.
+static void append_pin_list(char* p, char* end, exp_pins_t pins) {
+    bool first = true;
+    for (uint8_t pin_num = 0; pin_num < EXP_MAX_PINS; pin_num++) {
+        if (!(pins & ((exp_pins_t)1 << pin_num))) {
+            continue;
+        }
+        uint8_t last = pin_num;
+        while (last + 1 < EXP_MAX_PINS && (pins & ((exp_pins_t)1 << (last + 1)))) {
+            ++last;
+        }
+        // Room for ",NN-NN" plus "..." and the terminator
+        if (end - p < 10) {
+            strcpy(p, "...");
+            return;
+        }
+        if (!first) {
+            *p++ = ',';
+        }
+        first = false;
+        p     = append_uint(p, pin_num);
+        if (last != pin_num) {
+            *p++ = '-';
+            p    = append_uint(p, last);
+        }
+        pin_num = last;
+    }
+}
+
+// NAK with a message that lists the pins that failed
+static void nak_pins(const char* prefix, exp_pins_t failed) {
+    char errmsg[100];
+    strcpy(errmsg, prefix);
+    append_pin_list(errmsg + strlen(errmsg), errmsg + sizeof(errmsg), failed);
+    expander_nak(errmsg);
+}
+
+// Cycle counts for an operation, accumulated since the last STATS report
+typedef struct {
+    uint32_t count;
+    uint32_t cycles;
+    uint32_t max;
+} cycle_stats_t;
+
+static cycle_stats_t parse_stats = { 0 };  // Parsing of every line from the host
+static cycle_stats_t scan_stats  = { 0 };  // Input scans by expander_poll()
+
+static void add_cycles(cycle_stats_t* stats, uint32_t cycles) {
+    ++stats->count;
+    stats->cycles += cycles;
+    if (cycles > stats->max) {
+        stats->max = cycles;
+    }
+}
+
+// Send "NAME:N=<count>,AVG=<cycles>,MAX=<cycles>" followed by extra, if
+// any, and restart the accumulation
+static void report_cycles(const char* name, cycle_stats_t* stats, const char* extra) {
+    char  msg[80];
+    char* p = msg;
+    strcpy(p, name);
+    strcat(p, ":N=");
+    p = append_uint(p + strlen(p), stats->count);
+    strcpy(p, ",AVG=");
+    p = append_uint(p + strlen(p), stats->count ? stats->cycles / stats->count : 0);
+    strcpy(p, ",MAX=");
+    p = append_uint(p + strlen(p), stats->max);
+    if (extra) {
+        strcpy(p, extra);
+    }
+    expander_feedback(msg, 10);
+
+    stats->count  = 0;
+    stats->cycles = 0;
+    stats->max    = 0;
+}
+
+// Baud rate negotiation state.  A rate of 0 is the one the app started with.
+static uint32_t link_baud      = 0;      // The rate in use
+static uint32_t previous_baud  = 0;      // The rate to go back to if the new one is not confirmed
+static bool     baud_probation = false;  // Waiting for the host to confirm the new rate
+static int      baud_window_ms;          // Start of the current error counting window
+static uint32_t baud_window_errors;      // expander_link_errors() at the start of the window
+
+static void change_baud(uint32_t baud) {
+    expander_set_baud(baud);
+    link_baud          = baud;
+    baud_window_ms     = milliseconds();
+    baud_window_errors = expander_link_errors();
+}
+
+// Called from expander_poll() to fall back when the new rate is not
+// confirmed in time or the link shows errors
+static void check_baud() {
+    if (!link_baud && !baud_probation) {
+        return;
+    }
+    uint32_t errors  = expander_link_errors() - baud_window_errors;
+    int      elapsed = milliseconds() - baud_window_ms;
+    if (baud_probation) {
+        if (errors >= BAUD_MAX_ERRORS || elapsed >= BAUD_CONFIRM_MS) {
+            baud_probation = false;
+            change_baud(previous_baud);
+        }
+        return;
+    }
+    if (errors >= BAUD_MAX_ERRORS) {
+        change_baud(0);
+    } else if (elapsed >= 1000) {
+        baud_window_ms     = milliseconds();
+        baud_window_errors = expander_link_errors();
+    }
+}
+
+// Send "PWM:IO=<n>,FREQ=<hz>,STEPS=<steps>" for each of the pins, so
+// the host can see how closely the requested frequency was met and how
+// fine the duty cycle control is
+static void report_pwm(exp_pins_t pins) {
+    static const char* const keys[] = { "IO", "FREQ", "STEPS" };
+    for (uint8_t pin_num = 0; pins; pin_num++, pins >>= 1) {
+        uint32_t values[3] = { pin_num };
+        if ((pins & 1) && expander_pwm_info(pin_num, &values[1], &values[2])) {
+            expander_report_values("PWM", keys, values, 3);
+        }
+    }
+}
+
+// Send "CONFLICT:IO=<n>,WITH=<pin>,FREQ=<hz>" for each of the pins that
+// could not get a timer channel because another pin was using it
+static void report_conflicts(exp_pins_t pins) {
+    static const char* const keys[] = { "IO", "WITH", "FREQ" };
+    for (uint8_t pin_num = 0; pins; pin_num++, pins >>= 1) {
+        uint8_t  other;
+        uint32_t values[3] = { pin_num };
+        if ((pins & 1) && expander_pin_conflict(pin_num, &other, &values[2])) {
+            values[1] = other;
+            expander_report_values("CONFLICT", keys, values, 3);
+        }
+    }
+}
+
+bool expander_handle_command(char* command) {
+    exp_cmd_t cmd;
+
+    uint32_t start  = expander_cycles();
+    bool     is_exp = expander_parse_command(command, &cmd);
+    add_cycles(&parse_stats, expander_cycles() - start);
+
+    if (!is_exp) {
+        return false;
+    }
+    if (baud_probation && cmd.type != exp_cmd_error) {
+        baud_probation = false;  // The host is talking at the new rate
+    }
+
+    switch (cmd.type) {
+        case exp_cmd_rst:
+            report_mode = 0;
+            expander_rst();
+            return false;  // This message is not specific to the expander
+        case exp_cmd_id:
+            expander_report_info();
+            expander_ack();
+            return true;
+        case exp_cmd_report:
+            report_mode = cmd.report;
+            expander_ack();
+            return true;
+        case exp_cmd_stats:
+            expander_report_stats();
+            expander_ack();
+            return true;
+        case exp_cmd_baud:
+            if (!expander_baud_supported(cmd.baud)) {
+                expander_nak("EXP Error baud rate not supported");
+                return true;
+            }
+            expander_ack();
+            previous_baud  = link_baud;
+            baud_probation = true;
+            change_baud(cmd.baud);
+            return true;
+        case exp_cmd_error:
+            expander_nak(cmd.errmsg);
+            return true;
+        case exp_cmd_ramp: {
+            exp_pins_t failed = 0;
+            exp_pins_t pins   = cmd.pins;
+            for (uint8_t pin_num = 0; pins; pin_num++, pins >>= 1) {
+                if ((pins & 1) && !expander_ramp(pin_num, cmd.duty, RAMP_DUTY_MAX, cmd.ramp_ms, cmd.curve)) {
+                    failed |= (exp_pins_t)1 << pin_num;
+                }
+            }
+            if (failed) {
+                nak_pins("EXP Error ramp io.", failed);
+            } else {
+                expander_ack();
+            }
+            return true;
+        }
+        case exp_cmd_servo: {
+            exp_pins_t failed = 0;
+            exp_pins_t pins   = cmd.pins;
+            for (uint8_t pin_num = 0; pins; pin_num++, pins >>= 1) {
+                if ((pins & 1) && !expander_servo_move(pin_num, cmd.pulse_us)) {
+                    failed |= (exp_pins_t)1 << pin_num;
+                }
+            }
+            if (failed) {
+                nak_pins("EXP Error servo io.", failed);
+            } else {
+                expander_ack();
+            }
+            return true;
+        }
+        case exp_cmd_io: {
+            // Configure every pin in the set, then send one ACK or NAK for
+            // the whole set, followed by the initial states of the pins that
+            // were configured successfully.
+            exp_pins_t failed = 0;
+            exp_pins_t pins   = cmd.pins;
+            for (uint8_t pin_num = 0; pins; pin_num++, pins >>= 1) {
+                if (pins & 1) {
+                    if (!expander_ini(pin_num, cmd.mode)) {
+                        failed |= (exp_pins_t)1 << pin_num;
+                    } else if ((cmd.mode & PIN_COMPLEMENTARY) && !expander_complementary(pin_num, cmd.deadtime_ns, cmd.brk)) {
+                        deinit_pin(pin_num);
+                        failed |= (exp_pins_t)1 << pin_num;
+                    } else if ((cmd.mode & PIN_SERVO) && !expander_servo(pin_num, cmd.min_us, cmd.max_us, cmd.slew)) {
+                        deinit_pin(pin_num);
+                        failed |= (exp_pins_t)1 << pin_num;
+                    } else if (cmd.mode & PIN_INPUT) {
+                        set_pin_debounce(pin_num, cmd.filter, cmd.debounce_ms);
+                    }
+                }
+            }
+            if (cmd.mode & PIN_PWM) {
+                report_pwm(cmd.pins & ~failed);
+                report_conflicts(failed);
+            }
+            if (failed) {
+                nak_pins("EXP Error io.", failed);
+            } else {
+                expander_ack();
+            }
+            pins = cmd.pins & ~failed;
+            for (uint8_t pin_num = 0; pins; pin_num++, pins >>= 1) {
+                if (pins & 1) {
+                    expander_get(pin_num);
+                }
+            }
+            flush_pin_reports();
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+void __attribute__((weak)) expander_report_stats() {
+    char inputs[16] = ",INPUTS=";
+    append_uint(inputs + strlen(inputs), input_pin_count());
+
+    report_cycles("PARSE", &parse_stats, NULL);
+    report_cycles("SCAN", &scan_stats, inputs);
+    expander_report_app_stats();
+}
+
+void __attribute__((weak)) expander_report_app_stats() {}
+
+bool __attribute__((weak)) expander_baud_supported(uint32_t baud) {
+    return false;
+}
+void __attribute__((weak)) expander_set_baud(uint32_t baud) {}
+uint32_t __attribute__((weak)) expander_link_errors() {
+    return 0;
+}
+
+void expander_report_values(const char* name, const char* const keys[], const uint32_t values[], int count) {
+    char  msg[120];
+    char* p   = msg;
+    char* end = msg + sizeof(msg);
+    strcpy(p, name);
+    p += strlen(p);
+    for (int i = 0; i < count; i++) {
+        // Leave room for the separators and a 10-digit value
+        if (p + strlen(keys[i]) + 13 > end) {
+            break;
+        }
+        *p++ = i ? ',' : ':';
+        strcpy(p, keys[i]);
+        p += strlen(p);
+        *p++ = '=';
+        p    = append_uint(p, values[i]);
+    }
+    expander_feedback(msg, 10);
+}
+
+bool __attribute__((weak)) expander_complementary(uint8_t pin_num, uint32_t deadtime_ns, uint8_t brk) {
+    return false;
+}
+
+bool __attribute__((weak)) expander_ramp(uint8_t pin_num, uint32_t numerator, uint32_t denominator, uint32_t ms, uint8_t curve) {
+    return set_output(pin_num, numerator, denominator) == fail_none;
+}
+
+bool __attribute__((weak)) expander_pwm_info(uint8_t pin_num, uint32_t* frequency, uint32_t* steps) {
+    return false;
+}
+
+bool __attribute__((weak)) expander_servo(uint8_t pin_num, uint16_t min_us, uint16_t max_us, uint32_t slew) {
+    return false;
+}
+
+bool __attribute__((weak)) expander_servo_move(uint8_t pin_num, uint16_t pulse_us) {
+    return false;
+}
+
+bool __attribute__((weak)) expander_pin_conflict(uint8_t pin_num, uint8_t* other_pin, uint32_t* frequency) {
+    return false;
+}
+
+uint32_t __attribute__((weak)) expander_cycles() {
+    return 0;
+}
+
 // Implement these to handle expander IO messages
 bool __attribute__((weak)) expander_rst() {
     deinit_all_pins();
@@ -207,11 +1032,12 @@ bool __attribute__((weak)) expander_ini(uint8_t pin_num, pin_mode_t pinmode) {
 }
 bool __attribute__((weak)) expander_get_all() {
     update_all_pins();
-    read_all_pins(expander_pin_msg);
+    read_all_pins(pin_reporter());
+    flush_pin_reports();
     return true;
 }
 bool __attribute__((weak)) expander_get(uint8_t pin_num) {
-    read_pin(expander_pin_msg, pin_num);
+    read_pin(pin_reporter(), pin_num);
     return true;
 }
 bool __attribute__((weak)) expander_set(uint8_t pin_num, int32_t numerator, uint32_t denominator) {
@@ -219,7 +1045,12 @@ bool __attribute__((weak)) expander_set(uint8_t pin_num, int32_t numerator, uint
 }
 
 void __attribute__((weak)) expander_poll() {
-    read_all_pins(expander_pin_msg);
+    check_baud();
+
+    uint32_t start = expander_cycles();
+    read_all_pins(pin_reporter());
+    add_cycles(&scan_stats, expander_cycles() - start);
+    flush_pin_reports();
 }
 
 #ifdef __cplusplus
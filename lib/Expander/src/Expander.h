@@ -12,6 +12,75 @@ extern "C" {
 
 // IO expander API
 
+// Parsed form of a report line.  expander_parse_command() fills it in
+// from a single left-to-right scan of the line, without modifying or
+// copying the line.
+typedef enum {
+    exp_cmd_none = 0,  // Not an expander command
+    exp_cmd_rst,       // [MSG:RST]
+    exp_cmd_id,        // [EXP:ID]
+    exp_cmd_stats,     // [EXP:STATS]
+    exp_cmd_report,    // [EXP:REPORT=format]
+    exp_cmd_baud,      // [EXP:BAUD=rate]
+    exp_cmd_ramp,      // [EXP:ramp.N=duty,time=ms,curve=linear|s]
+    exp_cmd_servo,     // [EXP:servo.N=us]
+    exp_cmd_io,        // [EXP:io.N=mode], [EXP:io.N-M=mode], [EXP:io.N,M,...=mode]
+    exp_cmd_error,     // [EXP:...] that could not be parsed; errmsg says why
+} exp_cmd_type_t;
+
+// Pin numbers are limited to 0..63 by the size of the pin set and by
+// the pin report encoding.
+#define EXP_MAX_PINS 64
+typedef uint64_t exp_pins_t;  // Set of pins, bit N for io.N
+
+// Input report formats for [EXP:REPORT=...].  The default is one
+// 2-byte message per pin change.
+#define REPORT_BITMAP (1 << 0)      // Coalesce the changes from each poll into one frame
+#define REPORT_TIME_ABS (1 << 1)    // Follow each report with its microsecond timestamp
+#define REPORT_TIME_DELTA (1 << 2)  // Follow each report with microseconds since the previous one
+
+// Break input modes for complementary PWM.  An active break input turns
+// off the outputs of the timer until the pins are configured again.
+#define BREAK_NONE 0
+#define BREAK_LOW 1   // The break input is active low
+#define BREAK_HIGH 2  // The break input is active high
+
+// Ramp curves for [EXP:ramp.N=...]
+#define RAMP_LINEAR 0
+#define RAMP_S 1  // Smoothstep, starting and ending with zero slope
+
+// Ramp duty cycles are in the same units as the SetPWM realtime command
+#define RAMP_DUTY_MAX 1000
+
+// Servo pins default to the usual RC servo frame rate and pulse range
+#define SERVO_FREQUENCY 50
+#define SERVO_MIN_US 1000
+#define SERVO_MAX_US 2000
+
+typedef struct {
+    exp_cmd_type_t type;
+    exp_pins_t     pins;
+    pin_mode_t     mode;
+    uint8_t        filter;       // Debounce filter for inputs
+    uint16_t       debounce_ms;  // Debounce filter parameter
+    uint8_t        report;
+    uint16_t       deadtime_ns;  // Complementary PWM dead-time
+    uint8_t        brk;          // Complementary PWM break input mode
+    uint32_t       baud;
+    uint16_t       duty;      // Ramp target, 0..RAMP_DUTY_MAX
+    uint8_t        curve;     // Ramp curve
+    uint32_t       ramp_ms;   // Ramp time
+    uint16_t       min_us;    // Servo lower travel limit in microseconds
+    uint16_t       max_us;    // Servo upper travel limit in microseconds
+    uint32_t       slew;      // Servo slew limit in microseconds of pulse width per second, 0 for none
+    uint16_t       pulse_us;  // Servo position
+    const char*    errmsg;
+} exp_cmd_t;
+
+// expander_parse_command() decodes a report line into cmd.
+// It returns false if the line is not an expander command.
+extern bool expander_parse_command(const char* line, exp_cmd_t* cmd);
+
 // expander_handle_command() handles IO Expander MSG: messages.
 // The app must call it from the implementation of handle_msg()
 extern bool expander_handle_command(char* command);
@@ -41,6 +110,78 @@ extern void expander_start();
 
 extern void expander_report_info();
 
+// [EXP:STATS] - reports the cycle counts for command parsing and input
+// scans, and the number of configured inputs
+extern void expander_report_stats();
+
+// expander_report_app_stats() is called by the default expander_report_stats()
+// so the app can report its own counters, typically with expander_report_values().
+// The default implementation does nothing.
+extern void expander_report_app_stats();
+
+// Send "(EXP,<name>:<key>=<value>,...)"
+extern void expander_report_values(const char* name, const char* const keys[], const uint32_t values[], int count);
+
+// expander_complementary() makes a pin that has just been configured
+// as PWM also drive the inverted output of the same timer channel, with
+// deadtime_ns of dead time on each edge and the given break input mode.
+// The default implementation returns false, so the io command fails.
+extern bool expander_complementary(uint8_t pin_num, uint32_t deadtime_ns, uint8_t brk);
+
+// expander_ramp() moves a PWM pin from its present duty cycle to
+// numerator/denominator over ms milliseconds, following curve, without
+// further commands from the host.  The default implementation sets the
+// target duty cycle immediately.
+extern bool expander_ramp(uint8_t pin_num, uint32_t numerator, uint32_t denominator, uint32_t ms, uint8_t curve);
+
+// expander_pwm_info() returns the frequency that a PWM pin actually runs
+// at and the number of steps in its duty cycle.  When an io command sets
+// up PWM pins, these are reported before the ACK.  The default
+// implementation returns false, so nothing is reported.
+extern bool expander_pwm_info(uint8_t pin_num, uint32_t* frequency, uint32_t* steps);
+
+// expander_servo() makes a pin that has just been configured as PWM a
+// servo output whose pulse width is limited to min_us..max_us and
+// changes by at most slew microseconds per second, 0 meaning no limit.
+// The default implementation returns false, so the io command fails.
+extern bool expander_servo(uint8_t pin_num, uint16_t min_us, uint16_t max_us, uint32_t slew);
+
+// expander_servo_move() sets the pulse width of a servo pin, within its
+// travel limits.  The default implementation returns false.
+extern bool expander_servo_move(uint8_t pin_num, uint16_t pulse_us);
+
+// expander_pin_conflict() returns the pin that kept a PWM pin from
+// getting a timer channel at the requested frequency, and the frequency
+// that pin is running at.  When an io command fails for PWM pins, these
+// are reported before the NAK.  The default implementation returns
+// false, so nothing is reported.
+extern bool expander_pin_conflict(uint8_t pin_num, uint8_t* other_pin, uint32_t* frequency);
+
+// expander_cycles() returns a free-running CPU cycle count that is used
+// to measure the cost of command parsing.  The default implementation
+// returns 0; apps that have a cycle counter should override it.
+extern uint32_t expander_cycles();
+
+// Baud rate negotiation on the link to FluidNC.  The host sends
+// [EXP:BAUD=rate] at the current rate.  If the expander can use that
+// rate it sends ACK, then switches.  The host then switches too and must
+// send an expander command at the new rate within BAUD_CONFIRM_MS.
+// If it does not, or if line errors appear at the new rate, the
+// expander goes back to the previous rate.  Later bursts of errors at a
+// negotiated rate, such as from a host that has restarted, return it to
+// the rate it started with.
+#define BAUD_CONFIRM_MS 1000
+#define BAUD_MAX_ERRORS 4  // Line errors per second that cause a fallback
+
+// The app implements these to support negotiation.  The defaults refuse every rate.
+// expander_baud_supported() tells whether the UART can generate the rate accurately.
+// expander_set_baud() waits for pending output to be sent, then changes the rate;
+// 0 means the rate that the app started with.
+// expander_link_errors() returns a running count of framing, noise and overrun errors.
+extern bool     expander_baud_supported(uint32_t baud);
+extern void     expander_set_baud(uint32_t baud);
+extern uint32_t expander_link_errors();
+
 extern const char* fw_version;
 extern const char* board_name;
 
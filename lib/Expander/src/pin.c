@@ -10,7 +10,159 @@ extern "C" {
 
 extern int milliseconds();
 
-static int pin_limit = 0;
+// Input pin state, in structure-of-arrays form.  The bit sets let a scan
+// find every input that needs attention with a few word operations, and
+// the per-pin arrays are touched only for those pins.  input_pins is the
+// index of configured inputs; set_pin_mode() and deinit_pin() keep it
+// current, so no loop needs to visit pins that are not inputs.
+static pin_set_t input_pins      = 0;  // Pins configured as inputs
+static pin_set_t active_low_pins = 0;  // Inputs that are active low
+static pin_set_t pin_values      = 0;  // Last reported active state of each input
+static pin_set_t unknown_pins    = 0;  // Inputs whose state must be reported on the next scan
+static pin_set_t filtering_pins  = 0;  // Inputs whose debounce filter is in progress
+
+// Debounce filters run on a 1 ms tick.  The tick count is read once per
+// scan, and each filter advances by the number of ticks since the last scan.
+static uint8_t  filter_types[MAX_INPUT_PINS];
+static uint16_t filter_ticks[MAX_INPUT_PINS];    // Filter parameter N, in ticks
+static uint16_t filter_states[MAX_INPUT_PINS];   // Start tick, or integrator count
+static uint32_t change_micros[MAX_INPUT_PINS];   // When the reported change began
+static uint16_t last_tick = 0;
+
+#define PIN_BIT(pin_num) ((pin_set_t)1 << (pin_num))
+
+static void clear_input_state(uint8_t pin_num) {
+    if (pin_num >= MAX_INPUT_PINS) {
+        return;
+    }
+    pin_set_t bit = PIN_BIT(pin_num);
+    input_pins &= ~bit;
+    active_low_pins &= ~bit;
+    pin_values &= ~bit;
+    unknown_pins |= bit;
+    filtering_pins &= ~bit;
+    filter_types[pin_num] = filter_edge;
+    filter_ticks[pin_num] = DEFAULT_DEBOUNCE_MS;
+}
+
+static void report_change(pin_msg_t send_msg, uint8_t pin_num, bool active) {
+    pin_set_t bit = PIN_BIT(pin_num);
+    if (active) {
+        pin_values |= bit;
+    } else {
+        pin_values &= ~bit;
+    }
+    unknown_pins &= ~bit;
+    send_msg(pin_num, active);
+}
+
+// Run the debounce filter for one input, given a sample of its active
+// state that was taken at time micros.  elapsed is the number of ticks
+// since the previous scan, or 0 for samples that are not part of a scan.
+static void filter_pin(pin_msg_t send_msg, uint8_t pin_num, bool active, uint16_t now, uint16_t elapsed, uint32_t micros) {
+    pin_set_t bit       = PIN_BIT(pin_num);
+    bool      reported  = pin_values & bit;
+    bool      filtering = filtering_pins & bit;
+    uint16_t  n         = filter_ticks[pin_num];
+    uint16_t* state     = &filter_states[pin_num];
+
+    if (unknown_pins & bit) {
+        // The initial state is reported without filtering
+        change_micros[pin_num] = micros;
+        report_change(send_msg, pin_num, active);
+        if (filter_types[pin_num] == filter_count) {
+            *state = active ? n : 0;
+            filtering_pins &= ~bit;
+        } else if (filter_types[pin_num] == filter_edge) {
+            *state = now;
+            filtering_pins |= bit;
+        } else {
+            filtering_pins &= ~bit;
+        }
+        return;
+    }
+
+    switch (filter_types[pin_num]) {
+        case filter_edge:
+            // Report a change immediately, then ignore the pin for n ticks
+            if (filtering) {
+                if ((uint16_t)(now - *state) < n) {
+                    return;
+                }
+                filtering_pins &= ~bit;
+            }
+            if (active != reported) {
+                change_micros[pin_num] = micros;
+                report_change(send_msg, pin_num, active);
+                *state = now;
+                filtering_pins |= bit;
+            }
+            break;
+        case filter_stable:
+            // Report a change after the pin has stayed in its new state for n ticks
+            if (active == reported) {
+                filtering_pins &= ~bit;
+                return;
+            }
+            if (!filtering) {
+                change_micros[pin_num] = micros;
+                *state                 = now;
+                filtering_pins |= bit;
+            }
+            if ((uint16_t)(now - *state) >= n) {
+                report_change(send_msg, pin_num, active);
+                filtering_pins &= ~bit;
+            }
+            break;
+        case filter_count: {
+            // Integrate at most one sample per tick, reporting a change
+            // when the count reaches n for active or 0 for inactive
+            uint16_t count = *state;
+            if (elapsed) {
+                if (active) {
+                    count += count < n;
+                } else {
+                    count -= count > 0;
+                }
+            }
+            *state = count;
+            if (!filtering && active != reported) {
+                change_micros[pin_num] = micros;
+            }
+            if (reported ? count == 0 : count == n) {
+                report_change(send_msg, pin_num, !reported);
+                reported = !reported;
+            }
+            if (count != (reported ? n : 0)) {
+                filtering_pins |= bit;
+            } else {
+                filtering_pins &= ~bit;
+            }
+            break;
+        }
+    }
+}
+
+int set_pin_debounce(uint8_t pin_num, uint8_t filter, uint16_t ticks) {
+    if (pin_num >= MAX_INPUT_PINS || !(input_pins & PIN_BIT(pin_num))) {
+        return fail_not_capable;
+    }
+    if (filter > filter_count) {
+        return fail_unknown_parameter;
+    }
+    if (filter == filter_count && ticks == 0) {
+        ticks = 1;  // An integrator needs at least one sample
+    }
+    filter_types[pin_num] = filter;
+    filter_ticks[pin_num] = ticks;
+    unknown_pins |= PIN_BIT(pin_num);
+    filtering_pins &= ~PIN_BIT(pin_num);
+    return fail_none;
+}
+
+uint32_t __attribute__((weak)) microseconds() {
+    return (uint32_t)milliseconds() * 1000;
+}
 
 void init_pin(uint8_t pin_num) {
     if (pin_num >= n_pins) {
@@ -20,9 +172,7 @@ void init_pin(uint8_t pin_num) {
     pin->initialized        = false;
     pin->active_low         = false;
     pin->type               = pin_type_none;
-    pin->last_value         = -1;   // unknown
-    pin->debounce_ms        = 100;  // default
-    pin->last_change_millis = 0;
+    clear_input_state(pin_num);
 }
 
 int set_output(uint8_t pin_num, int32_t numerator, uint32_t denominator) {
@@ -36,47 +186,62 @@ int set_output(uint8_t pin_num, int32_t numerator, uint32_t denominator) {
 
     if (pin->type == pin_type_output) {
         bool is_high = (numerator != 0) ^ pin->active_low;
-        set_gpio(&pin->gpio, is_high);
+        set_gpio(&gpio_map[pin_num], is_high);
         return fail_none;
     }
     if (pin->type == pin_type_PWM) {
         if (numerator < 0 || (uint32_t)numerator > denominator) {
             return fail_range;
         }
-        set_pwm(&pin->gpio, numerator, denominator);
+        set_pwm(&gpio_map[pin_num], numerator, denominator);
         return fail_none;
     }
     return fail_not_capable;
 }
 
-bool pin_changed(uint8_t pin_num) {  // return true if value has changed
-    if (pin_num >= n_pins) {
-        return false;
-    }
-    pin_t* pin = &gpios[pin_num];
-
-    if (pin->type != pin_type_input) {
-        return false;
-    }
+// Set the outputs first_pin+N for each bit N in mask to the value of bit N
+// in values, all at the same time.  If any of the pins is not a digital
+// output, none of them are changed.
+int set_outputs(uint8_t first_pin, uint8_t mask, uint8_t values) {
+    const gpio_pin_t* group[8];
+    bool              high[8];
+    int               count = 0;
 
-    int new_value = get_gpio(&pin->gpio) ^ pin->active_low;
-
-    if (new_value != pin->last_value) {
-        if ((int)(milliseconds() - pin->last_change_millis) > (int)pin->debounce_ms) {
-            pin->last_value         = new_value;
-            pin->last_change_millis = milliseconds();  // maybe use for debouncing
-            return true;
+    for (int i = 0; i < 8; i++) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        uint8_t pin_num = first_pin + i;
+        if (pin_num >= n_pins) {
+            return fail_invalid_pin;
+        }
+        pin_t* pin = &gpios[pin_num];
+        if (!pin->initialized) {
+            return fail_not_initialized;
         }
+        if (pin->type != pin_type_output) {
+            return fail_not_capable;
+        }
+        group[count] = &gpio_map[pin_num];
+        high[count]  = ((values >> i) & 1) ^ pin->active_low;
+        ++count;
     }
+    set_gpio_group(group, high, count);
+    return fail_none;
+}
 
-    return false;
+// The time when the last reported change on the pin began
+uint32_t pin_change_micros(uint8_t pin_num) {
+    if (pin_num >= MAX_INPUT_PINS) {
+        return 0;
+    }
+    return change_micros[pin_num];
 }
 void force_pin_update(uint8_t pin_num) {
-    if (pin_num >= n_pins) {
+    if (pin_num >= MAX_INPUT_PINS) {
         return;
     }
-    pin_t* pin      = &gpios[pin_num];
-    pin->last_value = -1;
+    unknown_pins |= PIN_BIT(pin_num);
 }
 void deinit_pin(uint8_t pin_num) {
     if (pin_num >= n_pins) {
@@ -85,16 +250,14 @@ void deinit_pin(uint8_t pin_num) {
     pin_t* pin = &gpios[pin_num];
     if (pin->initialized) {
         if (pin->type == pin_type_PWM) {
-            deinit_pwm(&pin->gpio);
+            deinit_pwm(&gpio_map[pin_num]);
         } else {
-            deinit_gpio(&pin->gpio);
+            deinit_gpio(&gpio_map[pin_num]);
         }
         pin->initialized        = false;
         pin->active_low         = false;
         pin->type               = pin_type_none;
-        pin->last_value         = -1;   // unknown
-        pin->debounce_ms        = 100;  // default
-        pin->last_change_millis = 0;
+        clear_input_state(pin_num);
     }
 }
 
@@ -103,62 +266,106 @@ int set_pin_mode(uint8_t pin_num, pin_mode_t pinmode) {
         return fail_invalid_pin;
     }
     pin_t* pin = &gpios[pin_num];
+    if (pin->initialized && pin->type == pin_type_none) {
+        return fail_not_capable;  // Claimed for another pin's function
+    }
+    // Release what the pin is using now, such as a PWM timer channel,
+    // since deinit_pin() can only tell how to while the type is unchanged
+    deinit_pin(pin_num);
 
     // for now we assume all pins can input and output. Some can do PWM
 
-    pin->active_low = pinmode & PIN_ACTIVELOW;
+    pin->active_low = (pinmode & PIN_ACTIVELOW) != 0;
 
+    clear_input_state(pin_num);
     if (pinmode & PIN_PWM) {
         pin->type = pin_type_PWM;
     } else if (pinmode & PIN_OUTPUT) {
         pin->type = pin_type_output;
     } else if (pinmode & PIN_INPUT) {
-        pin->last_value = -1;  // reset to unknown value
-        pin->type       = pin_type_input;
+        if (pin_num >= MAX_INPUT_PINS) {
+            return fail_invalid_pin;
+        }
+        pin->type = pin_type_input;
     } else {
         return fail_unknown_parameter;
     }
-    if (set_gpio_mode(&pin->gpio, pinmode)) {
-        pin->initialized = true;
-        if (pin_num >= pin_limit) {
-            pin_limit = pin_num + 1;
+    if (set_gpio_mode(&gpio_map[pin_num], pinmode)) {
+        if (pin->type == pin_type_input) {
+            input_pins |= PIN_BIT(pin_num);
+            if (pin->active_low) {
+                active_low_pins |= PIN_BIT(pin_num);
+            }
         }
+        pin->initialized = true;
         return fail_none;
     }
     return fail_not_capable;
 }
 
 void init_all_pins() {
-    pin_limit = 0;
     for (size_t pin_num = 0; pin_num < n_pins; pin_num++) {
         init_pin(pin_num);
     }
 }
+// Only inputs report their state, so there is nothing to do for other pins
 void update_all_pins() {
-    for (size_t pin_num = 0; pin_num < pin_limit; pin_num++) {
-        force_pin_update(pin_num);
-    }
+    unknown_pins |= input_pins;
 }
 void deinit_all_pins() {
     for (size_t pin_num = 0; pin_num < n_pins; pin_num++) {
         deinit_pin(pin_num);
     }
 }
+int input_pin_count() {
+    int count = 0;
+    for (pin_set_t pins = input_pins; pins; pins &= pins - 1) {
+        ++count;
+    }
+    return count;
+}
 void read_pin(pin_msg_t send_msg, uint8_t pin_num) {
-    if (pin_num >= pin_limit) {
+    if (pin_num >= MAX_INPUT_PINS || !(input_pins & PIN_BIT(pin_num))) {
         return;
     }
-    pin_t* pin = &gpios[pin_num];
-    if (pin->type == pin_type_input) {
-        if (pin_changed(pin_num)) {
-            send_msg(pin_num, pin->last_value == 1);
+    bool active = get_gpio(&gpio_map[pin_num]) ^ gpios[pin_num].active_low;
+    filter_pin(send_msg, pin_num, active, milliseconds(), 0, microseconds());
+}
+// Feed the input changes that the platform layer captured by interrupt
+// through the debounce filters.  They count as samples at the times of
+// the edges, so a change that is reported carries the edge timestamp.
+static void read_pin_events(pin_msg_t send_msg, uint16_t now) {
+    gpio_event_t event;
+    while (get_gpio_event(&event)) {
+        uint8_t pin_num = event.pin_num;
+        if (pin_num < MAX_INPUT_PINS && (input_pins & PIN_BIT(pin_num))) {
+            filter_pin(send_msg, pin_num, event.high ^ gpios[pin_num].active_low, now, 0, event.micros);
         }
     }
 }
 void read_all_pins(pin_msg_t send_msg) {
-    for (size_t pin_num = 0; pin_num < pin_limit; pin_num++) {
-        read_pin(send_msg, pin_num);
+    uint16_t now     = milliseconds();
+    uint16_t elapsed = now - last_tick;
+    last_tick        = now;
+
+    read_pin_events(send_msg, now);
+
+    // Interrupt-driven inputs are sampled too, so the reported state
+    // catches up with the pin if an edge was lost to debouncing.
+    // All the inputs are sampled at once, and only the pins whose
+    // state differs from the last report or whose filters are in
+    // progress are visited.
+    pin_set_t active = get_gpio_levels(input_pins) ^ active_low_pins;
+    pin_set_t work   = ((active ^ pin_values) | unknown_pins | filtering_pins) & input_pins;
+    if (!work) {
+        return;
     }
+    uint32_t micros = microseconds();
+    do {
+        uint8_t pin_num = __builtin_ctzll(work);
+        work &= work - 1;
+        filter_pin(send_msg, pin_num, active & PIN_BIT(pin_num), now, elapsed, micros);
+    } while (work);
 }
 
 #ifdef __cplusplus
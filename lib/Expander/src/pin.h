@@ -23,6 +23,14 @@ enum pin_type_t {
     pin_type_PWM    = 3,
 };
 
+// Input debounce filters.  Their parameter N is in 1 ms ticks.
+enum pin_filter_t {
+    filter_edge   = 0,  // Report a change at once, then ignore the pin for N ticks
+    filter_stable = 1,  // Report a change once the pin has held its new state for N ticks
+    filter_count  = 2,  // N-sample integrator, sampled once per tick
+};
+#define DEFAULT_DEBOUNCE_MS 100
+
 enum FailCodes {
     fail_none              = 0,  // no problem
     fail_not_initialized   = 1,
@@ -32,29 +40,66 @@ enum FailCodes {
     fail_invalid_pin       = 5,
 };
 
+// The per-pin state that changes at runtime.  The platform's gpio_map[]
+// table, indexed by the same pin number, holds the constant description
+// of each pin so it can live in flash.  A pin that is initialized with
+// type none has been claimed by the platform for another pin's function,
+// such as a complementary PWM output, and cannot be configured.
 typedef struct {
-    gpio_pin_t gpio;
-
-    bool     initialized;
-    bool     active_low;
-    uint16_t type;
-    int      last_value;
-    int      debounce_ms;
-    int      last_change_millis;
+    uint8_t type : 2;
+    uint8_t initialized : 1;
+    uint8_t active_low : 1;
 } pin_t;
 
+// The state of input pins is kept in pin.c as bit sets indexed by pin
+// number, so only pins 0..MAX_INPUT_PINS-1 can be inputs.  Boards with
+// few pins can lower the limit to save RAM and use 32-bit sets.
+#ifndef MAX_INPUT_PINS
+#    define MAX_INPUT_PINS 64
+#endif
+#if MAX_INPUT_PINS > 32
+typedef uint64_t pin_set_t;
+#else
+typedef uint32_t pin_set_t;
+#endif
+
+// get_gpio_levels() is implemented by the platform layer.  It returns
+// the electrical levels of the given pins, one bit per pin number.
+pin_set_t get_gpio_levels(pin_set_t pins);
+
+// An input change captured by the platform layer, for example by a pin
+// interrupt, with the time at which it happened
+typedef struct {
+    uint32_t micros;
+    uint8_t  pin_num;
+    bool     high;
+} gpio_event_t;
+
+// get_gpio_event() is implemented by the platform layer.  It removes
+// the oldest captured input change from its queue, returning false if
+// the queue is empty.
+bool get_gpio_event(gpio_event_t* event);
+
+// microseconds() returns a free-running microsecond count used to
+// timestamp input changes.  The default implementation is derived
+// from milliseconds(); apps that have a finer timer should override it.
+uint32_t microseconds();
+
 void init_pin(uint8_t pin_num);
 void force_pin_update(uint8_t pin_num);
 void deinit_pin(uint8_t pin_num);
 int  set_pin_mode(uint8_t pin_num, pin_mode_t pinmode);
 int  set_output(uint8_t pin_num, int32_t numerator, uint32_t denominator);
-bool pin_changed(uint8_t pin_num);
+int  set_outputs(uint8_t first_pin, uint8_t mask, uint8_t values);
+int  set_pin_debounce(uint8_t pin_num, uint8_t filter, uint16_t ticks);
+uint32_t pin_change_micros(uint8_t pin_num);
 void read_pin(pin_msg_t send_msg, uint8_t pin_num);
 
 void init_all_pins();
 void update_all_pins();
 void deinit_all_pins();
 void read_all_pins(pin_msg_t send_msg);
+int  input_pin_count();
 
 #ifdef __cplusplus
 }
@@ -17,6 +17,9 @@ typedef uint32_t pin_mode_t;
 #define PIN_PULLUP (1 << 3)
 #define PIN_PULLDOWN (1 << 4)
 #define PIN_ACTIVELOW (1 << 5)
+#define PIN_IRQ (1 << 6)            // Input changes are captured by interrupt
+#define PIN_COMPLEMENTARY (1 << 7)  // PWM that also drives the channel's inverted output, with dead-time
+#define PIN_SERVO (1 << 8)          // PWM whose pulse width is set in microseconds
 
 #define IN PIN_INPUT
 #define OUT PIN_OUTPUT
@@ -24,7 +27,8 @@ typedef uint32_t pin_mode_t;
 #define PU PIN_PULLUP
 #define PD PIN_PULLDOWN
 
-#define PIN_FREQ_SHIFT 8
+// The PWM frequency occupies the high bits, so it can be up to 1048575 Hz
+#define PIN_FREQ_SHIFT 12
 
 #ifdef __cplusplus
 }